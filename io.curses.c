@@ -38,21 +38,10 @@ stos_preinit (void)
     idlok (stdscr, TRUE);
 }
 
-char
-stos_getc (void)
+// turns a curses key into what stos expects, and echoes it
+static char
+stos_key_cook (int ch)
 {
-    int ch;
-
-    nodelay (stdscr, FALSE);
-    timeout (-1);
-
-    for (;;)
-    {
-        ch = wgetch (stdscr);
-        if (ch != ERR)
-            break;
-    }
-
     if (ch == '\r' || ch == '\n' || ch == KEY_ENTER)
     {
         int y, x;
@@ -95,6 +84,97 @@ stos_getc (void)
     return (char)(ch & 0xff);
 }
 
+char
+stos_getc (void)
+{
+    int ch;
+
+    timeout (-1);
+
+    for (;;)
+    {
+        ch = wgetch (stdscr);
+        if (ch != ERR)
+            break;
+    }
+
+    return stos_key_cook (ch);
+}
+
+int
+stos_getc_nb (void)
+{
+    timeout (0);
+
+    int ch = wgetch (stdscr);
+    if (ch == ERR)
+        return -1;
+
+    return (unsigned char)stos_key_cook (ch);
+}
+
+void
+stos_poll (stos_size_t timeout_ms)
+{
+    timeout ((int)timeout_ms);
+
+    // wgetch does the waiting, the key goes back for stos_getc_nb to pick up
+    int ch = wgetch (stdscr);
+    if (ch != ERR)
+        ungetch (ch);
+}
+
+#ifdef _STOS_BLOCKS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// block device: a file, $STOS_BLOCKS or stos.blk in the working directory. blocks past its end read as blanks
+static FILE *
+stos_block_file (void)
+{
+    static FILE *f = NULL;
+    if (!f)
+    {
+        const char *path = getenv ("STOS_BLOCKS");
+        if (!path)
+            path = "stos.blk";
+        f = fopen (path, "r+b");
+        if (!f)
+            f = fopen (path, "w+b");
+    }
+    return f;
+}
+
+bool
+stos_block_read (stos_cell_t n, uint8_t *buf)
+{
+    FILE *f = stos_block_file ();
+    if (!f || fseek (f, (long)n * BLOCK_SIZE, SEEK_SET) != 0)
+        return false;
+
+    size_t got = fread (buf, 1, BLOCK_SIZE, f);
+    memset (buf + got, ' ', BLOCK_SIZE - got);
+    return !ferror (f);
+}
+
+bool
+stos_block_write (stos_cell_t n, const uint8_t *buf)
+{
+    FILE *f = stos_block_file ();
+    if (!f || fseek (f, (long)n * BLOCK_SIZE, SEEK_SET) != 0)
+        return false;
+    return fwrite (buf, 1, BLOCK_SIZE, f) == BLOCK_SIZE && fflush (f) == 0;
+}
+#endif
+
+int
+main (void)
+{
+    stos_preinit ();
+    stos_repl ();
+}
+
 void
 stos_putc (char c)
 {
@@ -0,0 +1,169 @@
+/* STOS - FORTH interpreter
+   Copyright (C) 2025 virtualgrub39
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// load generator for stos-server: keeps -c connections busy until -n requests are done,
+// then prints the latency percentiles and the throughput
+
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct sockaddr_un addr = { .sun_family = AF_UNIX };
+static const char *payload = "1 2 + .";
+static long total = 10000;
+static long next = 0, failed = 0;
+static double *latency; // microseconds, per request
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now_us (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// one request, true if the server answered OK
+static bool
+request (void)
+{
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    {
+        if (fd >= 0)
+            close (fd);
+        return false;
+    }
+
+    size_t len = strlen (payload);
+    bool ok = write (fd, payload, len) == (ssize_t)len;
+    shutdown (fd, SHUT_WR);
+
+    char buf[4096], tail[4] = "";
+    ssize_t n;
+    while ((n = read (fd, buf, sizeof (buf))) > 0)
+    {
+        // the status line is the last one, only its start matters
+        if (n >= 4)
+            memcpy (tail, buf + n - 4, 4);
+        else
+        {
+            memmove (tail, tail + n, 4 - n);
+            memcpy (tail + 4 - n, buf, n);
+        }
+    }
+    close (fd);
+    return ok && memcmp (tail, "\nOK\n", 4) == 0;
+}
+
+static void *
+client (void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock (&lock);
+        long i = next < total ? next++ : -1;
+        pthread_mutex_unlock (&lock);
+        if (i < 0)
+            return NULL;
+
+        double t = now_us ();
+        bool ok = request ();
+        latency[i] = now_us () - t;
+
+        if (!ok)
+        {
+            pthread_mutex_lock (&lock);
+            failed++;
+            pthread_mutex_unlock (&lock);
+        }
+    }
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile (double p)
+{
+    long i = (long)(p / 100 * (total - 1) + 0.5);
+    return latency[i];
+}
+
+static void
+usage (const char *argv0)
+{
+    fprintf (stderr, "usage: %s [-c connections] [-n requests] [-e source] socket\n", argv0);
+    exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+    long connections = 8;
+
+    int opt;
+    while ((opt = getopt (argc, argv, "c:n:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            connections = strtol (optarg, NULL, 0);
+            break;
+        case 'n':
+            total = strtol (optarg, NULL, 0);
+            break;
+        case 'e':
+            payload = optarg;
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (optind != argc - 1 || connections < 1 || total < 1 || strlen (argv[optind]) >= sizeof (addr.sun_path))
+        usage (argv[0]);
+    strcpy (addr.sun_path, argv[optind]);
+
+    latency = calloc (total, sizeof (double));
+    pthread_t *threads = calloc (connections, sizeof (pthread_t));
+
+    double start = now_us ();
+    for (long i = 0; i < connections; i++)
+        pthread_create (&threads[i], NULL, client, NULL);
+    for (long i = 0; i < connections; i++)
+        pthread_join (threads[i], NULL);
+    double elapsed = now_us () - start;
+
+    qsort (latency, total, sizeof (double), cmp_double);
+    printf ("%ld requests, %ld failed, %ld connections, %.0f req/s\n", total, failed, connections,
+            total / (elapsed / 1e6));
+    printf ("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", percentile (50), percentile (90),
+            percentile (99), percentile (99.9), latency[total - 1]);
+    return failed != 0;
+}
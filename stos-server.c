@@ -0,0 +1,317 @@
+/* STOS - FORTH interpreter
+   Copyright (C) 2025 virtualgrub39
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// evaluation server. one request per connection: the client sends FORTH source and shuts down its
+// writing side, the server answers with whatever the script printed, then a status line - "OK" or "ERR <why>".
+//
+// the VM is prepared once (primitives, plus the application library given with -l), then forked into a pool
+// of workers. every worker takes requests off the shared socket and goes back to the prepared state after each.
+// a request that runs past the time limit takes its worker down with it, the supervisor forks a fresh one
+
+#define _DEFAULT_SOURCE
+#include "stos.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SERVER_MAX_REQUEST (64 << 10)
+#define SERVER_MAX_REPLY (64 << 10)
+#define SERVER_MAX_WORKERS 256
+
+static char request[SERVER_MAX_REQUEST];
+static char reply[SERVER_MAX_REPLY];
+static size_t reply_len;
+static volatile sig_atomic_t client = -1;
+
+static struct stos_mark prepared;
+static uint8_t *prepared_vars;
+static stos_size_t prepared_vars_len;
+
+static long opt_timeout_ms = 1000;
+static long opt_insns = 0;
+static long opt_memory = 0;
+
+void
+stos_preinit (void)
+{
+}
+
+// requests have no terminal, `key` sees end of transmission
+char
+stos_getc (void)
+{
+    return 0x04;
+}
+
+int
+stos_getc_nb (void)
+{
+    return 0x04;
+}
+
+void
+stos_poll (stos_size_t timeout_ms)
+{
+    (void)timeout_ms;
+}
+
+void
+stos_putc (char c)
+{
+    if (c == '\r' || reply_len >= sizeof (reply))
+        return;
+    reply[reply_len++] = c;
+}
+
+static void
+send_all (int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write (fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+on_timeout (int sig)
+{
+    (void)sig;
+    static const char msg[] = "\nERR TIME LIMIT\n";
+    if (client >= 0)
+        send_all (client, msg, sizeof (msg) - 1);
+    _exit (1);
+}
+
+static void
+serve (int fd)
+{
+    size_t len = 0;
+    for (;;)
+    {
+        ssize_t n = read (fd, request + len, sizeof (request) - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+        if (len == sizeof (request))
+        {
+            static const char msg[] = "ERR REQUEST TOO LARGE\n";
+            send_all (fd, msg, sizeof (msg) - 1);
+            return;
+        }
+    }
+
+    struct itimerval limit = { .it_value = { opt_timeout_ms / 1000, opt_timeout_ms % 1000 * 1000 } };
+    client = fd;
+    setitimer (ITIMER_REAL, &limit, NULL);
+
+    reply_len = 0;
+    bool ok = stos_eval (request, len);
+
+    setitimer (ITIMER_REAL, &(struct itimerval){ 0 }, NULL);
+    client = -1;
+
+    send_all (fd, reply, reply_len);
+    if (ok)
+        send_all (fd, "\nOK\n", 4);
+    else
+    {
+        send_all (fd, "\nERR ", 5);
+        send_all (fd, stos_errstr, strlen (stos_errstr));
+        send_all (fd, "\n", 1);
+    }
+
+    stos_mark_reset (&prepared);
+    memcpy (stos_vars (NULL), prepared_vars, prepared_vars_len);
+}
+
+static void
+worker (int sock)
+{
+    signal (SIGALRM, on_timeout);
+    signal (SIGPIPE, SIG_IGN);
+
+    if (opt_memory)
+    {
+        struct rlimit rl;
+        getrlimit (RLIMIT_DATA, &rl);
+        rl.rlim_cur = opt_memory;
+        setrlimit (RLIMIT_DATA, &rl);
+    }
+
+    for (;;)
+    {
+        int fd = accept (sock, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror ("accept");
+            _exit (1);
+        }
+        serve (fd);
+        close (fd);
+    }
+}
+
+static bool
+load_library (const char *path)
+{
+    FILE *f = fopen (path, "r");
+    if (!f)
+    {
+        perror (path);
+        return false;
+    }
+
+    size_t len = fread (request, 1, sizeof (request), f);
+    fclose (f);
+    if (len == sizeof (request))
+    {
+        fprintf (stderr, "%s: too large\n", path);
+        return false;
+    }
+
+    if (!stos_eval (request, len))
+    {
+        fprintf (stderr, "%s: %s\n", path, stos_errstr);
+        return false;
+    }
+    return true;
+}
+
+static pid_t
+spawn (int sock)
+{
+    pid_t pid = fork ();
+    if (pid == 0)
+        worker (sock);
+    return pid;
+}
+
+static void
+usage (const char *argv0)
+{
+    fprintf (stderr,
+             "usage: %s [-w workers] [-l library.fs] [-t timeout-ms] [-i max-opcodes] [-m max-memory-bytes] socket\n",
+             argv0);
+    exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+    long workers = 4;
+    const char *library = NULL;
+
+    int opt;
+    while ((opt = getopt (argc, argv, "w:l:t:i:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            workers = strtol (optarg, NULL, 0);
+            break;
+        case 'l':
+            library = optarg;
+            break;
+        case 't':
+            opt_timeout_ms = strtol (optarg, NULL, 0);
+            break;
+        case 'i':
+            opt_insns = strtol (optarg, NULL, 0);
+            break;
+        case 'm':
+            opt_memory = strtol (optarg, NULL, 0);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (optind != argc - 1 || workers < 1 || workers > SERVER_MAX_WORKERS)
+        usage (argv[0]);
+
+    if (!stos_init ())
+    {
+        fprintf (stderr, "stos failed to initialize: %s\n", stos_errstr);
+        return 1;
+    }
+    if (library && !load_library (library))
+        return 1;
+
+    // part of the prepared state, every request starts with the full allowance again
+    char watchdog[32];
+    snprintf (watchdog, sizeof (watchdog), "%ld watchdog", opt_insns);
+    stos_eval (watchdog, strlen (watchdog));
+
+    stos_mark_take (&prepared);
+    uint8_t *vars = stos_vars (&prepared_vars_len);
+    prepared_vars = malloc (prepared_vars_len + 1);
+    memcpy (prepared_vars, vars, prepared_vars_len);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen (argv[optind]) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "%s: socket path too long\n", argv[optind]);
+        return 1;
+    }
+    strcpy (addr.sun_path, argv[optind]);
+    unlink (addr.sun_path);
+
+    int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0 || listen (sock, 128) < 0)
+    {
+        perror (addr.sun_path);
+        return 1;
+    }
+
+    pid_t pool[SERVER_MAX_WORKERS];
+    for (long i = 0; i < workers; i++)
+        pool[i] = spawn (sock);
+
+    // supervisor: replace workers that died (time limit, crash)
+    for (;;)
+    {
+        pid_t dead = wait (NULL);
+        if (dead < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror ("wait");
+            return 1;
+        }
+        for (long i = 0; i < workers; i++)
+            if (pool[i] == dead)
+                pool[i] = spawn (sock);
+    }
+}
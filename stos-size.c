@@ -0,0 +1,187 @@
+/* STOS - FORTH interpreter
+   Copyright (C) 2025 virtualgrub39
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// sizing tool: runs the application scripts a line at a time, like the REPL would get them, and prints
+// the smallest stos.h configuration they fit into (the high-water marks, plus -p percent of headroom).
+// what the scripts print goes to stderr
+
+#define _DEFAULT_SOURCE
+#include "stos.h"
+
+#ifndef _STOS_MEMSTATS
+#error "stos-size needs _STOS_MEMSTATS"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static long opt_headroom = 25;
+
+void
+stos_preinit (void)
+{
+}
+
+// scripts have no terminal, `key` sees end of transmission
+char
+stos_getc (void)
+{
+    return 0x04;
+}
+
+int
+stos_getc_nb (void)
+{
+    return 0x04;
+}
+
+void
+stos_poll (stos_size_t timeout_ms)
+{
+    (void)timeout_ms;
+}
+
+void
+stos_putc (char c)
+{
+    if (c != '\r')
+        fputc (c, stderr);
+}
+
+// evaluates path line by line, so the string space is reclaimed where the REPL would reclaim it
+static bool
+run_script (const char *path, size_t *longest)
+{
+    FILE *f = fopen (path, "r");
+    if (!f)
+    {
+        perror (path);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = true;
+    for (long n = 1; ok && (len = getline (&line, &cap, f)) >= 0; n++)
+    {
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            len--;
+        if ((size_t)len > *longest)
+            *longest = len;
+        if (len && !stos_eval (line, len))
+        {
+            fprintf (stderr, "%s:%ld: %s\n", path, n, stos_errstr);
+            ok = false;
+        }
+    }
+
+    free (line);
+    fclose (f);
+    return ok;
+}
+
+// the high-water mark and the headroom on top, never below min
+static unsigned long
+size_for (unsigned long high, unsigned long min)
+{
+    unsigned long n = high + (high * opt_headroom + 99) / 100;
+    return n < min ? min : n;
+}
+
+static unsigned long
+bytes_for (unsigned long high)
+{
+    return (size_for (high, 1) + 15) & ~15ul;
+}
+
+static void
+put_define (const char *name, unsigned long value, unsigned long high)
+{
+    printf ("#define %s %lu // %lu used\n", name, value, high);
+}
+
+static void
+usage (const char *argv0)
+{
+    fprintf (stderr, "usage: %s [-p headroom-percent] script.fs...\n", argv0);
+    exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt (argc, argv, "p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            opt_headroom = strtol (optarg, NULL, 0);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (optind == argc || opt_headroom < 0)
+        usage (argv[0]);
+
+    if (!stos_init ())
+    {
+        fprintf (stderr, "stos failed to initialize: %s\n", stos_errstr);
+        return 1;
+    }
+
+    size_t longest = 0;
+    for (int i = optind; i < argc; i++)
+        if (!run_script (argv[i], &longest))
+            return 1;
+
+    struct stos_mem m;
+    stos_mem_high (&m);
+
+    unsigned long vars = bytes_for (m.vsp);
+#ifdef _STOS_SANDBOX
+    // a power of two, with the string space (and block buffers) on top
+    unsigned long need = vars + bytes_for (m.strp) + STOS_BLOCK_SPACE;
+    for (vars = 1; vars < need; vars <<= 1)
+    {
+    }
+#endif
+    unsigned long words = size_for (m.words, m.prims);
+
+    printf ("// stos-size");
+    for (int i = optind; i < argc; i++)
+        printf (" %s", argv[i]);
+    printf ("\n// high-water marks plus %ld%%. byte counts were measured with %zu byte cells, ", opt_headroom,
+            sizeof (stos_cell_t));
+    printf ("a target with smaller ones needs less\n");
+    put_define ("DATA_STACK_SIZE", size_for (m.dsp, 1), m.dsp);
+    put_define ("BYTECODE_SIZE", bytes_for (m.pc), m.pc);
+    put_define ("VARSPACE_SIZE", vars, m.vsp);
+    put_define ("MAX_WORDS", words, m.words);
+    put_define ("INPUT_ACCUMULATOR_LEN", longest + 1, longest);
+    put_define ("STRINGSPACE_SIZE", bytes_for (m.strp), m.strp);
+    put_define ("MAX_PRIMITIVES", m.prims, m.prims);
+    put_define ("RETURN_STACK_SIZE", size_for (m.rsp, 1), m.rsp);
+    put_define ("COMPILE_STACK_SIZE", size_for (m.csp, 1), m.csp);
+    put_define ("TASK_DATA_STACK_SIZE", size_for (m.task_dsp, 1), m.task_dsp);
+    put_define ("TASK_RETURN_STACK_SIZE", size_for (m.task_rsp, 1), m.task_rsp);
+    return 0;
+}
@@ -15,9 +15,13 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#if defined(_STOS_MMAP) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and sigsetjmp under -std=c11
+#endif
+
 #include "stos.h"
 
-const char *stos_errstr = NULL;
+STOS_TLS const char *stos_errstr = NULL;
 
 void
 stos_seterrstr (const char *msg)
@@ -25,8 +29,12 @@ stos_seterrstr (const char *msg)
     stos_errstr = msg;
 }
 
-char stos_input[INPUT_ACCUMULATOR_LEN];
-char *stos_input_cursor = NULL;
+STOS_TLS char stos_input[INPUT_ACCUMULATOR_LEN];
+
+// source being interpreted is [stos_input_cursor, stos_input_end). it is never written to,
+// and doesn't have to be NUL-terminated
+STOS_TLS const char *stos_input_cursor; // both point into stos_input after stos_input_clear
+STOS_TLS const char *stos_input_end;
 
 enum token_type
 {
@@ -42,12 +50,19 @@ struct token
     union
     {
         stos_number_t number;
-        char *str;
+        struct
+        {
+            const char *str;
+            stos_size_t len;
+        };
     };
-} current_token;
+};
+
+STOS_TLS struct token current_token;
 
 stos_primitive_fn stos_prims[MAX_PRIMITIVES];
 stos_size_t stos_prim_count = 0;
+#define stos_prim_of(id) (stos_prims[stos_words[id].code_off])
 
 enum stos_opcode
 {
@@ -61,6 +76,18 @@ enum stos_opcode
     OPCODE_DO,
     OPCODE_LOOP,
     OPCODE_PRINT_STR,
+    OPCODE_PUSH_VAR, // pushes the address of a varspace offset, keeps bytecode position-independent
+    OPCODE_ACTIVATE, // ( task -- ) the task takes over the rest of the definition
+    OPCODE_PDO,        // ( limit start -- ) runs the body that follows for every index, then goes to the operand
+    OPCODE_PDO_REDUCE, // ( limit start -- x ) the same, the operand is the fold that combines what the body leaves
+    OPCODE_EXECUTE,    // ( xt -- ) calls the word
+    OPCODE_PUSH_XT,    // pushes its word id operand, which modules relocate like a call's
+#ifdef _STOS_COMPACT_BC
+    OPCODE_PUSH_BYTE,  // sign-extended 8 bit literal
+    OPCODE_PUSH_SHORT, // sign-extended 16 bit literal
+    // opcodes from here up are literals themselves, OPCODE_PUSH_SMALL + 64 pushes 0
+    OPCODE_PUSH_SMALL = 0x80,
+#endif
 };
 
 struct stos_word
@@ -68,17 +95,23 @@ struct stos_word
     char name[MAX_STRING_SIZE];
     stos_size_t code_off, code_len;
     uint8_t flags;
-} stos_words[MAX_WORDS];
-stos_size_t stos_word_count = 0;
+};
+
+#ifdef _STOS_MMAP
+struct stos_word *stos_words;
+#else
+struct stos_word stos_words[MAX_WORDS];
+#endif
+STOS_TLS stos_size_t stos_word_count = 0;
 
 enum stos_mode
 {
     MODE_INTERPRET,
     MODE_COMPILE_NAME,
     MODE_COMPILE_TOKS,
-} stos_mode
-    = MODE_INTERPRET,
-    stos_mode_prev = MODE_INTERPRET;
+};
+
+STOS_TLS enum stos_mode stos_mode = MODE_INTERPRET, stos_mode_prev = MODE_INTERPRET;
 
 void
 stos_mode_set (enum stos_mode mode)
@@ -93,22 +126,76 @@ stos_mode_revert (void)
     stos_mode = stos_mode_prev;
 }
 
+#ifdef _STOS_MMAP
+uint8_t *stos_bytecode;
+#else
 uint8_t stos_bytecode[BYTECODE_SIZE];
-stos_size_t stos_pc = 0;
+#endif
+STOS_TLS stos_size_t stos_pc = 0;
+
+// where this VM allocates words, bytecode and variables: all of each region,
+// unless _STOS_THREADS gives it a slice (words below stos_word_lo are the shared ones then)
+STOS_TLS stos_size_t stos_word_lo = 0, stos_word_hi = MAX_WORDS;
+STOS_TLS stos_size_t stos_pc_lo = 0, stos_pc_hi = BYTECODE_SIZE;
+STOS_TLS stos_size_t stos_vsp_lo = 0, stos_vsp_hi = STOS_VARS_LIMIT;
+
+#ifdef _STOS_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// the shared dictionary grows by publication: stos_share writes past these, then moves them with a release store.
+// readers only look below them, so the lookup and the exec loop never take a lock
+_Atomic stos_size_t stos_shared_words = 0, stos_shared_vsp = 0;
+#define stos_words_shared() atomic_load_explicit (&stos_shared_words, memory_order_acquire)
+void stos_vars_sync (void);
+#else
+#define stos_words_shared() 0
+#define stos_vars_sync()
+#endif
+
+// the stacks are pointers so the scheduler can swap in a task's own
+#ifdef _STOS_MMAP
+STOS_TLS stos_cell_t *stos_dstack;
+#else
+STOS_TLS stos_cell_t stos_dstack_main[DATA_STACK_SIZE];
+STOS_TLS stos_cell_t *stos_dstack = stos_dstack_main;
+#endif
+STOS_TLS stos_size_t stos_dstack_size = DATA_STACK_SIZE;
+STOS_TLS stos_size_t stos_dsp = 0;
 
-stos_cell_t stos_dstack[DATA_STACK_SIZE];
-stos_size_t stos_dsp = 0;
+#ifdef _STOS_MEMSTATS
+// high-water marks. the stacks count into the operator's slot, or into the tasks' one while a task runs
+struct stos_mem_stacks
+{
+    stos_size_t dsp, rsp;
+};
+
+STOS_TLS struct stos_mem_stacks stos_mem_stacks[2];
+STOS_TLS uint8_t stos_mem_slot = 0;
+STOS_TLS struct stos_mem stos_mem_hw; // the rest
+
+#define stos_mem_mark(hw, v)                                                                                           \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if ((v) > (hw))                                                                                                \
+            (hw) = (v);                                                                                                \
+    } while (0)
+#else
+#define stos_mem_mark(hw, v)
+#endif
 
 bool
 stos_push (stos_cell_t n)
 {
-    if (stos_dsp >= DATA_STACK_SIZE)
+    if (stos_dsp >= stos_dstack_size)
     {
         stos_seterrstr ("DATA STACK OVERFLOW");
         return false;
     }
 
     stos_dstack[stos_dsp++] = n;
+    stos_mem_mark (stos_mem_stacks[stos_mem_slot].dsp, stos_dsp);
     return true;
 }
 
@@ -125,19 +212,22 @@ stos_pop (stos_cell_t *n)
     return true;
 }
 
-stos_size_t stos_rstack[RETURN_STACK_SIZE];
-stos_size_t stos_rsp;
+STOS_TLS stos_size_t stos_rstack_main[RETURN_STACK_SIZE];
+STOS_TLS stos_size_t *stos_rstack; // stos_rstack_main, once stos_init ran
+STOS_TLS stos_size_t stos_rstack_size = RETURN_STACK_SIZE;
+STOS_TLS stos_size_t stos_rsp;
 
 bool
 stos_rpush (stos_size_t n)
 {
-    if (stos_rsp >= RETURN_STACK_SIZE)
+    if (stos_rsp >= stos_rstack_size)
     {
         stos_seterrstr ("RETURN STACK OVERFLOW");
         return false;
     }
 
     stos_rstack[stos_rsp++] = n;
+    stos_mem_mark (stos_mem_stacks[stos_mem_slot].rsp, stos_rsp);
     return true;
 }
 
@@ -154,8 +244,8 @@ stos_rpop (stos_size_t *n)
     return true;
 }
 
-stos_size_t stos_cstack[COMPILE_STACK_SIZE];
-stos_size_t stos_csp;
+STOS_TLS stos_size_t stos_cstack[COMPILE_STACK_SIZE];
+STOS_TLS stos_size_t stos_csp;
 
 bool
 stos_cpush (stos_size_t n)
@@ -167,6 +257,7 @@ stos_cpush (stos_size_t n)
     }
 
     stos_cstack[stos_csp++] = n;
+    stos_mem_mark (stos_mem_hw.csp, stos_csp);
     return true;
 }
 
@@ -183,1467 +274,5636 @@ stos_cpop (stos_size_t *n)
     return true;
 }
 
-uint8_t stos_varspace[VARSPACE_SIZE];
-stos_size_t stos_vsp = 0;
+// non-local errors. stos_guarded and `catch` set up a frame, stos_throw unwinds the C stack back to the
+// innermost one. the exec loop and the hot primitives throw instead of returning false all the way up
 
-char stos_string[STRINGSPACE_SIZE];
-stos_size_t stos_strp = 0;
+#include <setjmp.h>
+#include <stdlib.h>
 
-void
-stos_input_clear (void)
+#ifdef _STOS_MMAP // also left from the guard page handler, SA_NODEFER keeps the signal mask right
+#define stos_setjmp(env) sigsetjmp ((env), 0)
+#define stos_longjmp siglongjmp
+typedef sigjmp_buf stos_jmp_buf;
+#else
+#define stos_setjmp(env) setjmp (env)
+#define stos_longjmp longjmp
+typedef jmp_buf stos_jmp_buf;
+#endif
+
+// ANS throw codes, the ones the VM raises itself
+#define STOS_THROW_ABORT -1
+#define STOS_THROW_DSTACK_OVERFLOW -3
+#define STOS_THROW_DSTACK_UNDERFLOW -4
+#define STOS_THROW_RSTACK_OVERFLOW -5
+#define STOS_THROW_RSTACK_UNDERFLOW -6
+#define STOS_THROW_BAD_ADDRESS -9
+#define STOS_THROW_DIVISION -10
+#define STOS_THROW_UNDEFINED -13
+#define STOS_THROW_TIMEOUT -28 // "user interrupt", as close as ANS gets
+#define STOS_THROW_OTHER -4095 // an error that has only its message
+
+struct stos_frame
 {
-    stos_input[0] = 0;
-    stos_input_cursor = NULL;
-}
+    stos_jmp_buf env;
+    stos_size_t dsp, rsp, csp;
+    bool catching; // a `catch`. the others only clean up, or end the run (stos_guarded)
+    struct stos_frame *prev;
+};
 
-static inline bool
-stos_isspace (char c)
+STOS_TLS struct stos_frame *stos_frame_top = NULL;
+STOS_TLS stos_number_t stos_thrown; // what the frame was unwound with
+STOS_TLS bool stos_thrown_fatal;
+
+static void
+stos_frame_enter (struct stos_frame *f, bool catching)
 {
-    unsigned char uc = (unsigned char)c;
-    return (uc == ' ' || uc == '\t' || uc == '\n' || uc == '\r' || uc == '\f' || uc == '\v');
+    f->dsp = stos_dsp;
+    f->rsp = stos_rsp;
+    f->csp = stos_csp;
+    f->catching = catching;
+    f->prev = stos_frame_top;
+    stos_frame_top = f;
 }
 
-static inline bool
-stos_isdigit (char c)
+static void
+stos_frame_leave (struct stos_frame *f)
 {
-    unsigned char uc = (unsigned char)c;
-    return uc >= '0' && uc <= '9';
+    stos_frame_top = f->prev;
 }
 
-void *
-stos_memcpy (void *dest, const void *src, stos_size_t n)
+// unwinds to the innermost frame, which leaves it. a fatal error goes past every `catch`.
+// each VM entry point has a frame (stos_guarded), only a host calling a primitive on its own can get here without.
+// there is nowhere to go back to then, so it aborts
+_Noreturn static void
+stos_unwind (stos_number_t code, bool fatal)
 {
-    unsigned char *d = (unsigned char *)dest;
-    const unsigned char *s = (const unsigned char *)src;
-    while (n--)
-    {
-        *d++ = *s++;
-    }
-    return dest;
+    struct stos_frame *f = stos_frame_top;
+    while (f && fatal && f->catching)
+        f = f->prev;
+    if (!f)
+        abort ();
+
+    stos_thrown = code;
+    stos_thrown_fatal = fatal;
+    stos_frame_top = f->prev;
+    stos_longjmp (f->env, 1);
 }
 
-void
-stos_memmove (void *dest, const void *src, stos_size_t n)
+_Noreturn void
+stos_throw (stos_number_t code)
 {
-    unsigned char *d = (unsigned char *)dest;
-    const unsigned char *s = (const unsigned char *)src;
-    if (d == s || n == 0)
-        return;
-    if (d < s)
-    {
-        while (n--)
-            *d++ = *s++;
-    }
-    else
-    {
-        d += n;
-        s += n;
-        while (n--)
-            *--d = *--s;
-    }
+    stos_unwind (code, false);
 }
 
-void
-stos_memset (void *dest, uint8_t b, stos_size_t n)
+// for what a script must not be able to swallow, the watchdog
+_Noreturn void
+stos_throw_fatal (stos_number_t code)
 {
-    uint8_t *d = (uint8_t *)dest;
-    if (n == 0)
-        return;
-    while (n--)
-        *d++ = b;
-    return;
+    stos_unwind (code, true);
 }
 
-stos_size_t
-stos_strlen (const char *str)
+// a frame that only cleaned up passes it on
+_Noreturn void
+stos_rethrow (void)
 {
-    const char *s = str;
-    stos_size_t len = 0;
-    if (!s)
-        return 0;
-    while (*s++)
-        ++len;
-    return len;
+    stos_unwind (stos_thrown, stos_thrown_fatal);
 }
 
-stos_number_t
-stos_aton (const char *str, char **endptr)
+// the throwing stack operations, for the exec loop and the primitives
+static inline void
+stos_xpush (stos_cell_t n)
 {
-    const char *p = str;
-    stos_number_t result = 0;
-    bool negative = false;
-
-    while (stos_isspace (*p))
-        p++;
-
-    if (*p == '-')
-    {
-        negative = true;
-        p++;
-    }
-    else if (*p == '+')
-    {
-        p++;
-    }
-
-    if (!stos_isdigit (*p))
+    if (stos_dsp >= stos_dstack_size)
     {
-        if (endptr)
-            *endptr = (char *)str;
-        return 0;
+        stos_seterrstr ("DATA STACK OVERFLOW");
+        stos_throw (STOS_THROW_DSTACK_OVERFLOW);
     }
+    stos_dstack[stos_dsp++] = n;
+    stos_mem_mark (stos_mem_stacks[stos_mem_slot].dsp, stos_dsp);
+}
 
-    while (stos_isdigit (*p))
+static inline stos_cell_t
+stos_xpop (void)
+{
+    if (stos_dsp == 0)
     {
-        stos_number_t digit = *p - '0';
-        result = result * 10 + digit;
-        p++;
+        stos_seterrstr ("DATA STACK UNDERFLOW");
+        stos_throw (STOS_THROW_DSTACK_UNDERFLOW);
     }
-
-    if (endptr)
-        *endptr = (char *)p;
-
-    return negative ? -result : result;
+    return stos_dstack[--stos_dsp];
 }
 
-static inline char
-stos_toupper (char c)
+// the cell n below the top, which has to be there
+static inline stos_cell_t
+stos_xpeek (stos_size_t n)
 {
-    unsigned char uc = (unsigned char)c;
-    if (uc >= 'a' && uc <= 'z')
-        return (char)(uc - ('a' - 'A'));
-    return c;
+    if (stos_dsp <= n)
+    {
+        stos_seterrstr ("DATA STACK UNDERFLOW");
+        stos_throw (STOS_THROW_DSTACK_UNDERFLOW);
+    }
+    return stos_dstack[stos_dsp - 1 - n];
 }
 
-bool
-stos_strcasesame (const char *a, const char *b)
+static inline void
+stos_xrpush (stos_size_t n)
 {
-    if (!a || !b)
-        return 0;
-
-    while (*a && *b)
+    if (stos_rsp >= stos_rstack_size)
     {
-        if (stos_toupper (*a) != stos_toupper (*b))
-            return 0;
-        ++a;
-        ++b;
+        stos_seterrstr ("RETURN STACK OVERFLOW");
+        stos_throw (STOS_THROW_RSTACK_OVERFLOW);
     }
-    return (*a == *b) ? 1 : 0;
+    stos_rstack[stos_rsp++] = n;
+    stos_mem_mark (stos_mem_stacks[stos_mem_slot].rsp, stos_rsp);
 }
 
-void
-stos_write (const char *str)
+static inline stos_size_t
+stos_xrpop (void)
 {
-    while (*str)
+    if (stos_rsp == 0)
     {
-        stos_putc (*str);
-        str++;
+        stos_seterrstr ("RETURN STACK UNDERFLOW");
+        stos_throw (STOS_THROW_RSTACK_UNDERFLOW);
     }
+    return stos_rstack[--stos_rsp];
 }
 
+#ifdef _STOS_SANDBOX
+#define STOS_VARSPACE_ALLOC (VARSPACE_SIZE + sizeof (stos_cell_t)) // slack for a cell access at the very top
+#else
+#define STOS_VARSPACE_ALLOC VARSPACE_SIZE
+#endif
+
+#ifdef _STOS_MMAP
+STOS_TLS uint8_t *stos_varspace;
+#else
+STOS_TLS uint8_t stos_varspace[STOS_VARSPACE_ALLOC];
+#endif
+STOS_TLS stos_size_t stos_vsp = 0;
+
+// a control structure typed outside of a definition is compiled into the free bytecode above stos_pc,
+// run once it's closed, and given back (with the varspace its string literals took). while it's being compiled the
+// mode is MODE_COMPILE_TOKS
+STOS_TLS bool stos_scratch = false;
+STOS_TLS stos_size_t stos_scratch_pc, stos_scratch_csp, stos_scratch_vsp;
+
+// drops a structure that is still being compiled
 void
-stos_puts (const char *str)
+stos_scratch_drop (void)
 {
-    stos_write (str);
-    stos_putc ('\r');
-    stos_putc ('\n');
+    if (!stos_scratch)
+        return;
+    stos_pc = stos_scratch_pc;
+    stos_csp = stos_scratch_csp;
+    stos_vsp = stos_scratch_vsp;
+    stos_scratch = false;
+    stos_mode = stos_mode_prev = MODE_INTERPRET;
 }
 
-void
-stos_putn (stos_number_t n)
+// FORTH addresses. plain host pointers, or in the sandbox, masked offsets into the varspace.
+// stos_span cuts a range of len bytes at a short where the region ends
+#ifdef _STOS_SANDBOX
+#define STOS_ADDR_MASK ((stos_cell_t)VARSPACE_SIZE - 1)
+#define stos_ptr(a) ((void *)(stos_varspace + ((a) & STOS_ADDR_MASK)))
+#define stos_addr(p) ((stos_cell_t)((const uint8_t *)(p) - stos_varspace))
+
+static inline stos_cell_t
+stos_span (stos_cell_t a, stos_cell_t len)
 {
-    char buf[8 * sizeof (stos_number_t)]; // kindof stupid tbh, but it works?
-    uint8_t i = 0;
-    bool neg = (n < 0);
-    stos_number_t t = neg ? -n : n;
+    stos_cell_t room = VARSPACE_SIZE - (a & STOS_ADDR_MASK);
+    return len < room ? len : room;
+}
+#else
+#define stos_ptr(a) ((void *)(a))
+#define stos_addr(p) ((stos_cell_t)(p))
+#define stos_span(a, len) ((void)(a), (len))
+#endif
 
-    if (t == 0)
-        buf[i++] = '0';
-    while (t > 0 && i < (sizeof (buf) - 1))
-    {
-        buf[i++] = '0' + (t % 10);
-        t /= 10;
-    }
-    if (neg && i < (sizeof (buf) - 1))
-        buf[i++] = '-';
+// the same for arrays of n cells
+#define stos_cells(a, n) (stos_span ((a), (n) * sizeof (stos_cell_t)) / sizeof (stos_cell_t))
 
-    for (uint8_t a = 0, b = i; a < b / 2; ++a)
-    {
-        char tmp = buf[a];
-        buf[a] = buf[b - 1 - a];
-        buf[b - 1 - a] = tmp;
-    }
-    buf[i] = 0;
+#ifdef _STOS_MMAP
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-    stos_write (buf);
-}
+// growable regions for host builds. each one is a PROT_NONE reservation between two guard pages.
+// touching the reserved part commits it (in STOS_ARENA_CHUNK steps) from the SIGSEGV handler,
+// touching a guard page aborts the current line with an error instead of corrupting memory
 
-bool
-stos_token_next (void)
+#define STOS_ARENA_CHUNK ((size_t)64 << 10)
+
+struct stos_arena
 {
-    if (stos_input_cursor == NULL)
-        stos_input_cursor = stos_input;
+    const char *guard_msg;
+    uint8_t *base;
+    size_t size, committed;
+};
 
-    while (stos_isspace (*stos_input_cursor))
-        ++stos_input_cursor;
+enum
+{
+    ARENA_DSTACK,
+    ARENA_BYTECODE,
+    ARENA_VARSPACE,
+    ARENA_WORDS,
+    ARENA_COUNT,
+};
 
-    if (*stos_input_cursor == '\0')
-    {
-        current_token.type = TOKEN_EOEXPR;
-        return true;
-    }
+STOS_TLS struct stos_arena stos_arenas[ARENA_COUNT] = {
+    [ARENA_DSTACK] = { "DATA STACK GUARD PAGE HIT", NULL, DATA_STACK_SIZE * sizeof (stos_cell_t), 0 },
+    [ARENA_BYTECODE] = { "BYTECODE GUARD PAGE HIT", NULL, BYTECODE_SIZE, 0 },
+    [ARENA_VARSPACE] = { "VARIABLE SPACE GUARD PAGE HIT", NULL, STOS_VARSPACE_ALLOC, 0 },
+    [ARENA_WORDS] = { "DICTIONARY GUARD PAGE HIT", NULL, MAX_WORDS * sizeof (struct stos_word), 0 },
+};
 
-    char *p = stos_input_cursor, *q = stos_input_cursor;
+size_t stos_page_size;
 
-    while (!stos_isspace (*q) && *q)
-        q++;
+// the handler the host had before stos_arenas_init, faults that aren't ours go to it
+struct sigaction stos_guard_prev;
+bool stos_guard_installed;
 
-    stos_input_cursor = q;
-    if (*q != '\0')
-        stos_input_cursor += 1;
+static size_t
+stos_round_up (size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
 
-    *q = '\0';
+static void
+stos_guard_handler (int sig, siginfo_t *si, void *uctx)
+{
+    uint8_t *addr = (uint8_t *)si->si_addr;
 
-    if (*p == 0x04) // EOT
+    for (int i = 0; i < ARENA_COUNT; i++)
     {
-        current_token.type = TOKEN_REBOOT;
-        return true;
-    }
+        struct stos_arena *a = &stos_arenas[i];
+        if (addr < a->base - stos_page_size || addr >= a->base + a->size + stos_page_size)
+            continue;
 
-    if (stos_isdigit (*p) || *p == '-' || *p == '+')
-    {
-        char *endptr = NULL;
-        stos_number_t d = stos_aton (p, &endptr);
-        if (*endptr == '\0') // valid number
+        if (addr >= a->base + a->committed && addr < a->base + a->size)
         {
-            current_token.type = TOKEN_NUMBER;
-            current_token.number = (stos_number_t)d;
-            return true;
+            size_t upto = stos_round_up (addr - a->base + 1, STOS_ARENA_CHUNK);
+            if (upto > a->size)
+                upto = a->size;
+            if (mprotect (a->base + a->committed, upto - a->committed, PROT_READ | PROT_WRITE) == 0)
+            {
+                a->committed = upto;
+                return;
+            }
+            if (stos_frame_top) // over RLIMIT_DATA, most likely
+            {
+                stos_seterrstr ("OUT OF MEMORY");
+                stos_throw (STOS_THROW_BAD_ADDRESS);
+            }
+        }
+        else if (stos_frame_top && (addr < a->base || addr >= a->base + a->size))
+        {
+            stos_seterrstr (a->guard_msg);
+            stos_throw (STOS_THROW_BAD_ADDRESS);
         }
+        break;
     }
 
-    if (*p == '\'')
+    // not ours, pass it on to the host's handler, or fault again with the default action
+    if (stos_guard_prev.sa_flags & SA_SIGINFO)
+        stos_guard_prev.sa_sigaction (sig, si, uctx);
+    else if (stos_guard_prev.sa_handler != SIG_DFL && stos_guard_prev.sa_handler != SIG_IGN)
+        stos_guard_prev.sa_handler (sig);
+    else
+        signal (sig, SIG_DFL);
+}
+
+// gives the pages above keep back to the system, after the region shrank
+void
+stos_arena_trim (struct stos_arena *a, size_t keep)
+{
+    keep = stos_round_up (keep, STOS_ARENA_CHUNK);
+    if (keep >= a->committed)
+        return;
+    mmap (a->base + keep, a->committed - keep, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+          0);
+    a->committed = keep;
+}
+
+bool
+stos_arenas_init (void)
+{
+    bool first = !stos_bytecode;
+    if (first)
+        stos_page_size = (size_t)sysconf (_SC_PAGESIZE);
+
+    for (int i = 0; i < ARENA_COUNT; i++)
     {
-        if (*(p + 1) && *(p + 2) == '\'') // char
+        struct stos_arena *a = &stos_arenas[i];
+        a->size = stos_round_up (a->size, stos_page_size);
+#ifdef _STOS_THREADS
+        // every VM has its own table, the shared regions are reserved by the first one
+        if (!first && (i == ARENA_BYTECODE || i == ARENA_WORDS))
         {
-            current_token.type = TOKEN_NUMBER;
-            current_token.number = (stos_number_t) * (p + 1);
-            return true;
+            a->base = (i == ARENA_BYTECODE) ? stos_bytecode : (uint8_t *)stos_words;
+            continue;
+        }
+#endif
+        uint8_t *p = mmap (NULL, a->size + 2 * stos_page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1, 0);
+        if (p == MAP_FAILED)
+        {
+            stos_seterrstr ("CAN'T RESERVE MEMORY");
+            return false;
         }
+        a->base = p + stos_page_size;
     }
 
-    current_token.type = TOKEN_WORD;
-    current_token.str = p;
+    stos_dstack = (stos_cell_t *)stos_arenas[ARENA_DSTACK].base;
+    stos_varspace = stos_arenas[ARENA_VARSPACE].base;
+    if (first)
+    {
+        stos_bytecode = stos_arenas[ARENA_BYTECODE].base;
+        stos_words = (struct stos_word *)stos_arenas[ARENA_WORDS].base;
+    }
+
+    if (stos_guard_installed)
+        return true;
+    struct sigaction sa = { 0 };
+    sa.sa_sigaction = stos_guard_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset (&sa.sa_mask);
+    if (sigaction (SIGSEGV, &sa, &stos_guard_prev) != 0)
+    {
+        stos_seterrstr ("CAN'T INSTALL SIGSEGV HANDLER");
+        return false;
+    }
+    stos_guard_installed = true;
     return true;
 }
+#endif
 
-void
-stos_bc_emit_op (enum stos_opcode op)
+// transient string space. strings live until the end of the top-level line that made them
+// (see stos_str_reset in main), allocation is a bump of stos_strp and never overlaps live strings
+STOS_TLS stos_size_t stos_strp = 0;
+
+#ifndef _STOS_NO_STRINGS
+#ifdef _STOS_SANDBOX
+#define stos_string ((char *)stos_varspace + STOS_VARS_LIMIT) // strings need to be addressable too
+#else
+STOS_TLS char stos_string[STRINGSPACE_SIZE];
+#endif
+
+char *
+stos_str_alloc (stos_size_t len)
 {
-    for (size_t i = 0; i < SIZEOF_OPCODE; i++)
-        stos_bytecode[stos_pc++] = (uint8_t)(op >> (i * 8));
+    if (len >= STRINGSPACE_SIZE - stos_strp) // len + 1 would wrap for the largest len
+    {
+        stos_seterrstr ("STRING SPACE AT CAPACITY");
+        return NULL;
+    }
+
+    char *str = stos_string + stos_strp;
+    str[len] = '\0';
+    stos_strp += len + 1;
+    stos_mem_mark (stos_mem_hw.strp, stos_strp);
+    return str;
 }
+#endif
 
 void
-stos_bc_emit_size (stos_size_t s)
+stos_str_reset (void)
 {
-    for (size_t i = 0; i < sizeof (stos_size_t); i++)
-        stos_bytecode[stos_pc++] = (uint8_t)(s >> (i * 8));
+    stos_strp = 0;
 }
 
 void
-stos_bc_emit_addr (stos_cell_t addr)
+stos_input_set (const char *src, stos_size_t len)
 {
-    for (size_t i = 0; i < sizeof (stos_cell_t); i++)
-        stos_bytecode[stos_pc++] = (uint8_t)(addr >> (i * 8));
+    stos_input_cursor = src;
+    stos_input_end = src + len;
 }
 
-// void
-// stos_bc_emit_number (stos_number_t num)
-// {
-//     for (size_t i = 0; i < sizeof (stos_number_t); i++)
-//         stos_bytecode[stos_pc++] = (uint8_t)(num >> (i * 8));
-// }
-
-// stos_number_t
-// stos_bc_read_number (stos_size_t *addr)
-// {
-//     stos_number_t result = 0;
-//     for (size_t i = 0; i < sizeof (stos_number_t); i++)
-//         result |= ((stos_number_t)stos_bytecode[(*addr)++]) << (i * 8);
-//     return result;
-// }
-
-stos_size_t
-stos_bc_read_size (stos_size_t *addr)
+void
+stos_input_clear (void)
 {
-    stos_size_t result = 0;
-    for (size_t i = 0; i < sizeof (stos_size_t); i++)
-        result |= ((stos_size_t)stos_bytecode[(*addr)++]) << (i * 8);
-    return result;
+    stos_input_set (stos_input, 0);
 }
 
-stos_cell_t
-stos_bc_read_addr (stos_size_t *addr)
+static inline bool
+stos_isspace (char c)
 {
-    stos_cell_t result = 0;
-    for (size_t i = 0; i < sizeof (stos_cell_t); i++)
-        result |= ((stos_cell_t)stos_bytecode[(*addr)++]) << (i * 8);
-    return result;
+    unsigned char uc = (unsigned char)c;
+    return (uc == ' ' || uc == '\t' || uc == '\n' || uc == '\r' || uc == '\f' || uc == '\v');
 }
 
-stos_ssize_t
-stos_word_create (const char *name, uint8_t flags)
+// value of c as a digit, or a value >= 16 when it isn't one
+static inline uint8_t
+stos_digit (char c)
 {
-    if (stos_word_count >= MAX_WORDS)
-        return -1;
+    unsigned char uc = (unsigned char)c;
+    if (uc >= '0' && uc <= '9')
+        return uc - '0';
+    uc |= 0x20; // lowercase
+    if (uc >= 'a' && uc <= 'f')
+        return uc - 'a' + 10;
+    return 0xff;
+}
+
+#if defined(STOS_SIMD_AVX2)
+#include <immintrin.h>
+#elif defined(STOS_SIMD_SSE2)
+#include <emmintrin.h>
+#endif
+
+// cell-sized view of memory, used by the word-at-a-time fallbacks below
+typedef stos_cell_t __attribute__ ((__may_alias__)) stos_mcell_t;
+// the same, for cells that may sit at any address (FORTH arrays, `@` and `!`)
+typedef stos_cell_t __attribute__ ((__may_alias__, __aligned__ (1))) stos_ucell_t;
+#define STOS_CELL_MASK ((stos_cell_t)(sizeof (stos_cell_t) - 1))
+
+static inline bool
+stos_co_aligned (const void *a, const void *b)
+{
+    return (((stos_cell_t)a ^ (stos_cell_t)b) & STOS_CELL_MASK) == 0;
+}
+
+void *
+stos_memcpy (void *dest, const void *src, stos_size_t n)
+{
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+
+#if defined(STOS_SIMD_AVX2)
+    for (; n >= 32; n -= 32, d += 32, s += 32)
+        _mm256_storeu_si256 ((__m256i *)d, _mm256_loadu_si256 ((const __m256i *)s));
+#endif
+#if defined(STOS_SIMD_SSE2)
+    for (; n >= 16; n -= 16, d += 16, s += 16)
+        _mm_storeu_si128 ((__m128i *)d, _mm_loadu_si128 ((const __m128i *)s));
+#else
+    if (n >= 2 * sizeof (stos_cell_t) && stos_co_aligned (d, s))
+    {
+        for (; (stos_cell_t)d & STOS_CELL_MASK; --n)
+            *d++ = *s++;
+        for (; n >= sizeof (stos_cell_t); n -= sizeof (stos_cell_t), d += sizeof (stos_cell_t), s += sizeof (stos_cell_t))
+            *(stos_mcell_t *)d = *(const stos_mcell_t *)s;
+    }
+#endif
+
+    while (n--)
+    {
+        *d++ = *s++;
+    }
+    return dest;
+}
+
+// copies from the end of the buffers towards the beginning, in blocks.
+// matches a byte-wise backward copy unless dest < src and the ranges overlap
+static void
+stos_memcpy_back (void *dest, const void *src, stos_size_t n)
+{
+    unsigned char *d = (unsigned char *)dest + n;
+    const unsigned char *s = (const unsigned char *)src + n;
+
+#if defined(STOS_SIMD_AVX2)
+    for (; n >= 32; n -= 32)
+    {
+        d -= 32;
+        s -= 32;
+        _mm256_storeu_si256 ((__m256i *)d, _mm256_loadu_si256 ((const __m256i *)s));
+    }
+#endif
+#if defined(STOS_SIMD_SSE2)
+    for (; n >= 16; n -= 16)
+    {
+        d -= 16;
+        s -= 16;
+        _mm_storeu_si128 ((__m128i *)d, _mm_loadu_si128 ((const __m128i *)s));
+    }
+#else
+    if (n >= 2 * sizeof (stos_cell_t) && stos_co_aligned (d, s))
+    {
+        for (; (stos_cell_t)d & STOS_CELL_MASK; --n)
+            *--d = *--s;
+        for (; n >= sizeof (stos_cell_t); n -= sizeof (stos_cell_t))
+        {
+            d -= sizeof (stos_cell_t);
+            s -= sizeof (stos_cell_t);
+            *(stos_mcell_t *)d = *(const stos_mcell_t *)s;
+        }
+    }
+#endif
+
+    while (n--)
+        *--d = *--s;
+}
+
+void
+stos_memmove (void *dest, const void *src, stos_size_t n)
+{
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+    if (d == s || n == 0)
+        return;
+    // forward block copy is safe whenever dest is below src
+    if (d < s || d >= s + n)
+        stos_memcpy (d, s, n);
+    else
+        stos_memcpy_back (d, s, n);
+}
+
+void
+stos_memset (void *dest, uint8_t b, stos_size_t n)
+{
+    uint8_t *d = (uint8_t *)dest;
+    if (n == 0)
+        return;
+
+#if defined(STOS_SIMD_AVX2)
+    __m256i v32 = _mm256_set1_epi8 ((char)b);
+    for (; n >= 32; n -= 32, d += 32)
+        _mm256_storeu_si256 ((__m256i *)d, v32);
+#endif
+#if defined(STOS_SIMD_SSE2)
+    __m128i v16 = _mm_set1_epi8 ((char)b);
+    for (; n >= 16; n -= 16, d += 16)
+        _mm_storeu_si128 ((__m128i *)d, v16);
+#else
+    if (n >= 2 * sizeof (stos_cell_t))
+    {
+        stos_cell_t v = (stos_cell_t)-1 / 0xff * b; // b in every byte of the cell
+        for (; (stos_cell_t)d & STOS_CELL_MASK; --n)
+            *d++ = b;
+        for (; n >= sizeof (stos_cell_t); n -= sizeof (stos_cell_t), d += sizeof (stos_cell_t))
+            *(stos_mcell_t *)d = v;
+    }
+#endif
+
+    while (n--)
+        *d++ = b;
+    return;
+}
+
+// returns <0, 0 or >0, like memcmp
+int
+stos_memcmp (const void *a, const void *b, stos_size_t n)
+{
+    const uint8_t *p = (const uint8_t *)a;
+    const uint8_t *q = (const uint8_t *)b;
+
+#if defined(STOS_SIMD_SSE2)
+    for (; n >= 16; n -= 16, p += 16, q += 16)
+    {
+        __m128i eq = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)p), _mm_loadu_si128 ((const __m128i *)q));
+        unsigned mask = (unsigned)_mm_movemask_epi8 (eq) ^ 0xffffu;
+        if (mask)
+        {
+            unsigned i = (unsigned)__builtin_ctz (mask);
+            return (int)p[i] - (int)q[i];
+        }
+    }
+#else
+    if (n >= 2 * sizeof (stos_cell_t) && stos_co_aligned (p, q))
+    {
+        for (; (stos_cell_t)p & STOS_CELL_MASK; --n, ++p, ++q)
+            if (*p != *q)
+                return (int)*p - (int)*q;
+        // skip over equal cells, the differing one (if any) is resolved bytewise below
+        for (; n >= sizeof (stos_cell_t); n -= sizeof (stos_cell_t), p += sizeof (stos_cell_t), q += sizeof (stos_cell_t))
+            if (*(const stos_mcell_t *)p != *(const stos_mcell_t *)q)
+                break;
+    }
+#endif
+
+    for (; n; --n, ++p, ++q)
+        if (*p != *q)
+            return (int)*p - (int)*q;
+    return 0;
+}
+
+// first occurrence of byte c in [s, s+n), or NULL
+const void *
+stos_memchr (const void *s, uint8_t c, stos_size_t n)
+{
+    const uint8_t *p = (const uint8_t *)s;
+
+#if defined(STOS_SIMD_SSE2)
+    __m128i v = _mm_set1_epi8 ((char)c);
+    for (; n >= 16; n -= 16, p += 16)
+    {
+        unsigned mask = (unsigned)_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)p), v));
+        if (mask)
+            return p + __builtin_ctz (mask);
+    }
+#endif
+
+    for (; n; --n, ++p)
+        if (*p == c)
+            return p;
+    return NULL;
+}
+
+// first occurrence of needle in haystack, or NULL
+const void *
+stos_memmem (const void *hay, stos_size_t hlen, const void *needle, stos_size_t nlen)
+{
+    const uint8_t *h = (const uint8_t *)hay;
+    const uint8_t *n = (const uint8_t *)needle;
+
+    if (nlen == 0)
+        return hay;
+
+    while (hlen >= nlen)
+    {
+        const uint8_t *p = stos_memchr (h, n[0], hlen - nlen + 1);
+        if (!p)
+            return NULL;
+        if (stos_memcmp (p + 1, n + 1, nlen - 1) == 0)
+            return p;
+        hlen -= (p + 1) - h;
+        h = p + 1;
+    }
+    return NULL;
+}
+
+stos_size_t
+stos_strlen (const char *str)
+{
+    const char *s = str;
+    stos_size_t len = 0;
+    if (!s)
+        return 0;
+    while (*s++)
+        ++len;
+    return len;
+}
+
+// parses a number at the start of [str, end): optional sign, optional base prefix
+// ($ hex, % binary, # decimal), then digits. stops at the first character that isn't a digit,
+// returns false if there were no digits at all
+bool
+stos_aton (const char *str, const char *end, stos_number_t *out, const char **endptr)
+{
+    const char *p = str;
+    stos_number_t result = 0;
+    bool negative = false;
+    uint8_t base = 10;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    if (p < end && (*p == '$' || *p == '%' || *p == '#'))
+    {
+        base = (*p == '$') ? 16 : (*p == '%') ? 2 : 10;
+        p++;
+        if (p < end && (*p == '-' || *p == '+') && str + 1 == p)
+            negative = (*p++ == '-');
+    }
+
+    const char *digits = p;
+    for (uint8_t d; p < end && (d = stos_digit (*p)) < base; p++)
+        result = result * base + d;
+
+    *endptr = p;
+    if (p == digits)
+        return false;
+
+    *out = negative ? -result : result;
+    return true;
+}
+
+static inline char
+stos_toupper (char c)
+{
+    unsigned char uc = (unsigned char)c;
+    if (uc >= 'a' && uc <= 'z')
+        return (char)(uc - ('a' - 'A'));
+    return c;
+}
+
+// compares the span [a, a+len) against the NUL-terminated name, ignoring case
+bool
+stos_strcasesame (const char *a, stos_size_t len, const char *name)
+{
+    if (!a || !name)
+        return 0;
+
+    for (stos_size_t i = 0; i < len; ++i)
+    {
+        if (!name[i] || stos_toupper (a[i]) != stos_toupper (name[i]))
+            return 0;
+    }
+    return name[len] == '\0';
+}
+
+void
+stos_write (const char *str)
+{
+    while (*str)
+    {
+        stos_putc (*str);
+        str++;
+    }
+}
+
+void
+stos_puts (const char *str)
+{
+    stos_write (str);
+    stos_putc ('\r');
+    stos_putc ('\n');
+}
+
+void
+stos_putn (stos_number_t n)
+{
+    char buf[8 * sizeof (stos_number_t)]; // kindof stupid tbh, but it works?
+    uint8_t i = 0;
+    bool neg = (n < 0);
+    stos_number_t t = neg ? -n : n;
+
+    if (t == 0)
+        buf[i++] = '0';
+    while (t > 0 && i < (sizeof (buf) - 1))
+    {
+        buf[i++] = '0' + (t % 10);
+        t /= 10;
+    }
+    if (neg && i < (sizeof (buf) - 1))
+        buf[i++] = '-';
+
+    for (uint8_t a = 0, b = i; a < b / 2; ++a)
+    {
+        char tmp = buf[a];
+        buf[a] = buf[b - 1 - a];
+        buf[b - 1 - a] = tmp;
+    }
+    buf[i] = 0;
+
+    stos_write (buf);
+}
+
+#if defined(STOS_SIMD_AVX2)
+#define STOS_SCAN_BLOCK 32
+#define STOS_SCAN_ALL 0xffffffffu
+typedef uint32_t stos_scan_mask_t;
+
+// bit i set when p[i] is whitespace
+static inline stos_scan_mask_t
+stos_space_mask (const char *p)
+{
+    __m256i c = _mm256_loadu_si256 ((const __m256i *)p);
+    __m256i sp = _mm256_cmpeq_epi8 (c, _mm256_set1_epi8 (' '));
+    __m256i t = _mm256_sub_epi8 (c, _mm256_set1_epi8 ('\t')); // \t \n \v \f \r map to 0..4
+    __m256i ctl = _mm256_cmpeq_epi8 (_mm256_min_epu8 (t, _mm256_set1_epi8 (4)), t);
+    return (stos_scan_mask_t)_mm256_movemask_epi8 (_mm256_or_si256 (sp, ctl));
+}
+#elif defined(STOS_SIMD_SSE2)
+#define STOS_SCAN_BLOCK 16
+#define STOS_SCAN_ALL 0xffffu
+typedef uint32_t stos_scan_mask_t;
+
+// bit i set when p[i] is whitespace
+static inline stos_scan_mask_t
+stos_space_mask (const char *p)
+{
+    __m128i c = _mm_loadu_si128 ((const __m128i *)p);
+    __m128i sp = _mm_cmpeq_epi8 (c, _mm_set1_epi8 (' '));
+    __m128i t = _mm_sub_epi8 (c, _mm_set1_epi8 ('\t')); // \t \n \v \f \r map to 0..4
+    __m128i ctl = _mm_cmpeq_epi8 (_mm_min_epu8 (t, _mm_set1_epi8 (4)), t);
+    return (stos_scan_mask_t)_mm_movemask_epi8 (_mm_or_si128 (sp, ctl));
+}
+#endif
+
+// first non-whitespace character in [p, end), or end
+static const char *
+stos_skip_space (const char *p, const char *end)
+{
+#ifdef STOS_SCAN_BLOCK
+    for (; end - p >= STOS_SCAN_BLOCK; p += STOS_SCAN_BLOCK)
+    {
+        stos_scan_mask_t m = stos_space_mask (p) ^ STOS_SCAN_ALL;
+        if (m)
+            return p + __builtin_ctz (m);
+    }
+#endif
+    while (p < end && stos_isspace (*p))
+        p++;
+    return p;
+}
+
+// first whitespace character in [p, end), or end
+static const char *
+stos_skip_word (const char *p, const char *end)
+{
+#ifdef STOS_SCAN_BLOCK
+    for (; end - p >= STOS_SCAN_BLOCK; p += STOS_SCAN_BLOCK)
+    {
+        stos_scan_mask_t m = stos_space_mask (p);
+        if (m)
+            return p + __builtin_ctz (m);
+    }
+#endif
+    while (p < end && !stos_isspace (*p))
+        p++;
+    return p;
+}
+
+bool
+stos_token_next (void)
+{
+    const char *end = stos_input_end;
+    const char *p = stos_skip_space (stos_input_cursor, end);
+
+    if (p == end)
+    {
+        stos_input_cursor = end;
+        current_token.type = TOKEN_EOEXPR;
+        return true;
+    }
+
+    const char *q = p;
+
+    // numbers are parsed while scanning, a token only falls back to being a word
+    // when the digits are followed by something other than whitespace
+    if (stos_digit (*p) < 10 || *p == '-' || *p == '+' || *p == '$' || *p == '%' || *p == '#')
+    {
+        stos_number_t d;
+        bool number = stos_aton (p, end, &d, &q);
+        if (number && (q == end || stos_isspace (*q)))
+        {
+            stos_input_cursor = (q == end) ? q : q + 1;
+            current_token.type = TOKEN_NUMBER;
+            current_token.number = d;
+            return true;
+        }
+    }
+
+    q = stos_skip_word (q, end);
+    stos_input_cursor = (q == end) ? q : q + 1;
+
+    if (q - p == 1 && *p == 0x04) // EOT
+    {
+        current_token.type = TOKEN_REBOOT;
+        return true;
+    }
+
+    if (q - p == 3 && p[0] == '\'' && p[2] == '\'') // char
+    {
+        current_token.type = TOKEN_NUMBER;
+        current_token.number = (stos_number_t)p[1];
+        return true;
+    }
+
+    current_token.type = TOKEN_WORD;
+    current_token.str = p;
+    current_token.len = q - p;
+    return true;
+}
+
+// past stos_pc_hi the byte is dropped, but still counted. stos_interpret fails the token that did it
+static inline void
+stos_bc_emit_byte (uint8_t b)
+{
+    if (stos_pc < stos_pc_hi)
+        stos_bytecode[stos_pc] = b;
+    stos_pc++;
+}
+
+void
+stos_bc_emit_op (enum stos_opcode op)
+{
+    for (size_t i = 0; i < SIZEOF_OPCODE; i++)
+        stos_bc_emit_byte ((uint8_t)(op >> (i * 8)));
+}
+
+void
+stos_bc_emit_uint (stos_size_t v, uint8_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        stos_bc_emit_byte ((uint8_t)(v >> (i * 8)));
+}
+
+void
+stos_bc_emit_addr (stos_cell_t addr)
+{
+    for (size_t i = 0; i < sizeof (stos_cell_t); i++)
+        stos_bc_emit_byte ((uint8_t)(addr >> (i * 8)));
+}
+
+// void
+// stos_bc_emit_number (stos_number_t num)
+// {
+//     for (size_t i = 0; i < sizeof (stos_number_t); i++)
+//         stos_bytecode[stos_pc++] = (uint8_t)(num >> (i * 8));
+// }
+
+// stos_number_t
+// stos_bc_read_number (stos_size_t *addr)
+// {
+//     stos_number_t result = 0;
+//     for (size_t i = 0; i < sizeof (stos_number_t); i++)
+//         result |= ((stos_number_t)stos_bytecode[(*addr)++]) << (i * 8);
+//     return result;
+// }
+
+stos_size_t
+stos_bc_read_uint (stos_size_t *addr, uint8_t size)
+{
+    stos_size_t result = 0;
+    for (size_t i = 0; i < size; i++)
+        result |= ((stos_size_t)stos_bytecode[(*addr)++]) << (i * 8);
+    return result;
+}
+
+void
+stos_bc_patch_uint (stos_size_t addr, stos_size_t v, uint8_t size)
+{
+    for (size_t i = 0; i < size && addr + i < stos_pc_hi; i++)
+        stos_bytecode[addr + i] = (uint8_t)(v >> (i * 8));
+}
+
+stos_cell_t
+stos_bc_read_addr (stos_size_t *addr)
+{
+    stos_cell_t result = 0;
+    for (size_t i = 0; i < sizeof (stos_cell_t); i++)
+        result |= ((stos_cell_t)stos_bytecode[(*addr)++]) << (i * 8);
+    return result;
+}
+
+// largest string literal the bytecode can hold
+#define STOS_BC_STR_MAX ((stos_size_t)(~(stos_size_t)0 >> (8 * (sizeof (stos_size_t) - SIZEOF_STR_LEN))))
+
+// what `preduce` compiles after a parallel loop's body: CALL_ID of the combining word, RET
+#define STOS_PDO_FOLD_LEN (2 * SIZEOF_OPCODE + SIZEOF_WORD_ID)
+
+// pushes v, in the shortest form the encoding has
+void
+stos_bc_emit_literal (stos_cell_t v)
+{
+#ifdef _STOS_COMPACT_BC
+    intptr_t sv = (intptr_t)v;
+    if (sv >= -64 && sv < 64)
+    {
+        stos_bc_emit_op ((enum stos_opcode)(OPCODE_PUSH_SMALL + 64 + sv));
+        return;
+    }
+    if (sv >= INT8_MIN && sv <= INT8_MAX)
+    {
+        stos_bc_emit_op (OPCODE_PUSH_BYTE);
+        stos_bc_emit_uint ((stos_size_t)sv, 1);
+        return;
+    }
+    if (sv >= INT16_MIN && sv <= INT16_MAX)
+    {
+        stos_bc_emit_op (OPCODE_PUSH_SHORT);
+        stos_bc_emit_uint ((stos_size_t)sv, 2);
+        return;
+    }
+#endif
+    stos_bc_emit_op (OPCODE_PUSH_CELL);
+    stos_bc_emit_addr (v);
+}
+
+stos_ssize_t
+stos_word_create (const char *name, stos_size_t len, uint8_t flags)
+{
+    if (stos_word_count >= stos_word_hi)
+    {
+        stos_seterrstr ("DICTIONARY AT CAPACITY");
+        return -1;
+    }
+    if (len >= MAX_STRING_SIZE)
+    {
+        stos_seterrstr ("NAME TOO LONG");
+        return -1;
+    }
     stos_size_t id = stos_word_count++;
-    stos_memcpy (stos_words[id].name, name, stos_strlen (name));
+    stos_memcpy (stos_words[id].name, name, len);
+    stos_words[id].name[len] = '\0';
     stos_words[id].code_off = stos_pc;
     stos_words[id].code_len = 0;
     stos_words[id].flags = flags;
     return id;
 }
 
-void
-stos_word_finish (stos_size_t id)
+void
+stos_word_finish (stos_size_t id)
+{
+    stos_words[id].code_len = stos_pc - stos_words[id].code_off;
+}
+
+#ifdef _STOS_THREADS
+// a VM per thread. each one allocates from its own slice of the dictionary and the bytecode, above the shared part.
+// stos_share switches a VM over to the end of the shared part instead, and publishes the result when it's done
+
+#define STOS_VM_WORDS ((MAX_WORDS - SHARED_WORDS) / MAX_VMS)
+#define STOS_VM_BYTECODE ((BYTECODE_SIZE - SHARED_BYTECODE_SIZE) / MAX_VMS)
+
+pthread_mutex_t stos_shared_lock = PTHREAD_MUTEX_INITIALIZER; // writers of the shared dictionary, and the VM slots
+stos_size_t stos_shared_pc = 0;
+uint32_t stos_vms = 0;                          // slots in use
+uint8_t stos_shared_vars[SHARED_VARSPACE_SIZE]; // what the shared variables start out as, in every VM
+
+STOS_TLS int stos_vm = -1;
+STOS_TLS bool stos_sharing = false;
+STOS_TLS stos_size_t stos_vars_synced = 0; // how much of stos_shared_vars this VM has taken over
+
+bool stos_register_primitives (void);
+void stos_recover (void);
+
+struct stos_alloc
+{
+    stos_size_t word_lo, word_hi, words;
+    stos_size_t pc_lo, pc_hi, pc;
+    stos_size_t vsp_lo, vsp_hi, vsp;
+};
+
+static void
+stos_alloc_save (struct stos_alloc *a)
+{
+    *a = (struct stos_alloc){
+        stos_word_lo, stos_word_hi, stos_word_count, stos_pc_lo, stos_pc_hi, stos_pc, stos_vsp_lo, stos_vsp_hi, stos_vsp,
+    };
+}
+
+static void
+stos_alloc_load (const struct stos_alloc *a)
+{
+    stos_word_lo = a->word_lo;
+    stos_word_hi = a->word_hi;
+    stos_word_count = a->words;
+    stos_pc_lo = a->pc_lo;
+    stos_pc_hi = a->pc_hi;
+    stos_pc = a->pc;
+    stos_vsp_lo = a->vsp_lo;
+    stos_vsp_hi = a->vsp_hi;
+    stos_vsp = a->vsp;
+}
+
+// copies the initial values of variables other VMs have shared since the last time
+void
+stos_vars_sync (void)
+{
+    stos_size_t n = atomic_load_explicit (&stos_shared_vsp, memory_order_acquire);
+    if (n <= stos_vars_synced)
+        return;
+    stos_memcpy (stos_varspace + stos_vars_synced, stos_shared_vars + stos_vars_synced, n - stos_vars_synced);
+    stos_vars_synced = n;
+}
+
+// the caller holds stos_shared_lock. everything compiled until stos_share_end goes to the shared dictionary
+static void
+stos_share_begin (struct stos_alloc *saved)
+{
+    stos_vars_sync ();
+    stos_alloc_save (saved);
+
+    stos_size_t words = atomic_load_explicit (&stos_shared_words, memory_order_relaxed);
+    stos_size_t vsp = atomic_load_explicit (&stos_shared_vsp, memory_order_relaxed);
+    stos_alloc_load (&(struct stos_alloc){
+        words, SHARED_WORDS, words, 0, SHARED_BYTECODE_SIZE, stos_shared_pc, vsp, SHARED_VARSPACE_SIZE, vsp,
+    });
+    stos_sharing = true;
+}
+
+// publishes what was compiled since stos_share_begin if ok, and goes back to the VM's own slice.
+// nothing is ever freed in the shared part, readers can't be left holding a stale word
+static bool
+stos_share_end (const struct stos_alloc *saved, bool ok)
+{
+    if (ok && stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("UNFINISHED DEFINITION");
+        stos_recover ();
+        ok = false;
+    }
+
+    if (ok)
+    {
+        stos_size_t vsp = atomic_load_explicit (&stos_shared_vsp, memory_order_relaxed);
+        stos_memcpy (stos_shared_vars + vsp, stos_varspace + vsp, stos_vsp - vsp);
+        stos_vars_synced = stos_vsp;
+        stos_shared_pc = stos_pc;
+
+        // the words go last: a VM that finds them finds their code and variables too
+        atomic_store_explicit (&stos_shared_vsp, stos_vsp, memory_order_release);
+        atomic_store_explicit (&stos_shared_words, stos_word_count, memory_order_release);
+    }
+
+    stos_sharing = false;
+    stos_alloc_load (saved);
+    return ok;
+}
+
+bool
+stos_share (const char *src, size_t len)
+{
+    if (stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("UNFINISHED DEFINITION");
+        return false;
+    }
+
+    struct stos_alloc saved;
+    pthread_mutex_lock (&stos_shared_lock);
+    stos_share_begin (&saved);
+    bool ok = stos_share_end (&saved, stos_eval (src, len));
+    pthread_mutex_unlock (&stos_shared_lock);
+    return ok;
+}
+
+// gives the calling thread a VM slot. the first VM fills the shared dictionary with the primitives
+static bool
+stos_vm_attach (void)
+{
+    if (stos_vm >= 0) // a reboot keeps the slot
+        return true;
+
+    pthread_mutex_lock (&stos_shared_lock);
+    int vm = 0;
+    while (vm < MAX_VMS && (stos_vms & (1u << vm)))
+        vm++;
+
+    bool ok = vm < MAX_VMS;
+    if (!ok)
+        stos_seterrstr ("TOO MANY VMS");
+    else if ((ok = stos_arenas_init ()) && stos_prim_count == 0)
+    {
+        struct stos_alloc saved;
+        stos_share_begin (&saved);
+        ok = stos_share_end (&saved, stos_register_primitives ());
+    }
+
+    if (ok)
+    {
+        stos_vms |= 1u << vm;
+        stos_vm = vm;
+        stos_word_lo = SHARED_WORDS + vm * STOS_VM_WORDS;
+        stos_word_hi = stos_word_lo + STOS_VM_WORDS;
+        stos_pc_lo = SHARED_BYTECODE_SIZE + vm * STOS_VM_BYTECODE;
+        stos_pc_hi = stos_pc_lo + STOS_VM_BYTECODE;
+        stos_vsp_lo = SHARED_VARSPACE_SIZE;
+    }
+    pthread_mutex_unlock (&stos_shared_lock);
+    return ok;
+}
+
+void
+stos_detach (void)
+{
+    if (stos_vm < 0)
+        return;
+
+    // the stacks and the varspace go, the slice stays reserved for the next VM in this slot
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        struct stos_arena *a = &stos_arenas[i];
+        if (i == ARENA_BYTECODE || i == ARENA_WORDS)
+            continue;
+        munmap (a->base - stos_page_size, a->size + 2 * stos_page_size);
+        a->base = NULL;
+        a->committed = 0;
+    }
+
+    pthread_mutex_lock (&stos_shared_lock);
+    stos_vms &= ~(1u << stos_vm);
+    pthread_mutex_unlock (&stos_shared_lock);
+    stos_vm = -1;
+}
+#endif
+
+bool
+stos_primitive_compile (const char *name, stos_primitive_fn fn, uint8_t flags)
+{
+#ifdef _STOS_THREADS
+    // host primitives are the same for every VM
+    if (!stos_sharing)
+    {
+        struct stos_alloc saved;
+        pthread_mutex_lock (&stos_shared_lock);
+        stos_share_begin (&saved);
+        bool ok = stos_share_end (&saved, stos_primitive_compile (name, fn, flags));
+        pthread_mutex_unlock (&stos_shared_lock);
+        return ok;
+    }
+#endif
+
+    if (stos_prim_count >= MAX_PRIMITIVES)
+    {
+        stos_seterrstr ("PRIMITIVES AT CAPACITY");
+        return false;
+    }
+
+    stos_ssize_t id = stos_word_create (name, stos_strlen (name), flags | STOS_PRIMITIVE);
+    if (id < 0)
+        return false;
+
+    // primitives are never entered as bytecode, they take no bytecode space.
+    // code_off holds the index into stos_prims instead, host primitives can come after any other word
+    stos_words[id].code_off = stos_prim_count;
+    stos_prims[stos_prim_count++] = fn;
+    return true;
+}
+
+static bool
+stos_strto_wrdid_in (const char *str, stos_size_t len, stos_size_t lo, stos_size_t hi, uint16_t *out_id)
+{
+    for (stos_size_t i = lo; i < hi; ++i)
+    {
+        if (stos_strcasesame (str, len, stos_words[i].name))
+        {
+            *out_id = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the shared words (what's published of them), then this VM's own
+bool
+stos_strto_wrdid (const char *str, stos_size_t len, uint16_t *out_id)
+{
+    stos_size_t shared = stos_words_shared ();
+    stos_vars_sync (); // the variables of the words just found
+    return stos_strto_wrdid_in (str, len, 0, shared, out_id)
+           || stos_strto_wrdid_in (str, len, stos_word_lo, stos_word_count, out_id);
+}
+
+bool stos_exec (stos_size_t _pc, stos_size_t base);
+bool stos_pdo (stos_size_t body, stos_size_t fold);
+bool stos_interpret (void);
+
+// channels: bounded rings of cells for passing messages between tasks, and (under _STOS_THREADS) between VMs
+// and their threads. a channel is a process-wide handle, it stays valid for every VM and never goes away.
+// the ring takes any number of senders and receivers without a lock: every slot carries a sequence number
+// saying whose turn it is, a sender (receiver) claims the next one by moving tail (head) with a CAS.
+// only sleeping on a full or empty channel takes its mutex
+
+#ifdef _STOS_THREADS
+#define STOS_ATOMIC _Atomic
+#define stos_atomic_load(p) atomic_load_explicit (p, memory_order_acquire)
+#define stos_atomic_store(p, v) atomic_store_explicit (p, v, memory_order_release)
+#define stos_atomic_cas(p, expect, v)                                                                                  \
+    atomic_compare_exchange_weak_explicit (p, expect, v, memory_order_relaxed, memory_order_relaxed)
+#else
+#define STOS_ATOMIC
+#define stos_atomic_load(p) (*(p))
+#define stos_atomic_store(p, v) (*(p) = (v))
+#define stos_atomic_cas(p, expect, v) (*(p) = (v), true) // one thread, nobody can get in between
+#endif
+
+struct stos_channel_slot
+{
+    STOS_ATOMIC stos_size_t seq; // pos while it's free for the send of pos, pos + 1 once it holds that cell
+    stos_cell_t value;
+};
+
+struct stos_channel
+{
+    struct stos_channel_slot *slot;
+    stos_size_t mask;
+    STOS_ATOMIC stos_size_t head, tail; // next position to receive from, and to send to
+#ifdef _STOS_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    STOS_ATOMIC stos_size_t sleepers;
+#endif
+};
+
+struct stos_channel stos_channels[MAX_CHANNELS];
+struct stos_channel_slot stos_channel_slots[CHANNEL_SLOTS];
+STOS_ATOMIC stos_size_t stos_channel_count = 0;
+stos_size_t stos_channel_slots_used = 0;
+#ifdef _STOS_THREADS
+pthread_mutex_t stos_channel_lock = PTHREAD_MUTEX_INITIALIZER; // makers of channels
+#endif
+
+struct stos_channel *
+stos_channel_of (stos_cell_t ch)
+{
+    if ((stos_size_t)ch >= stos_atomic_load (&stos_channel_count))
+    {
+        stos_seterrstr ("INVALID CHANNEL");
+        return NULL;
+    }
+    return &stos_channels[ch];
+}
+
+bool
+stos_channel_put (struct stos_channel *c, stos_cell_t v)
+{
+    stos_size_t pos = stos_atomic_load (&c->tail);
+    struct stos_channel_slot *s;
+    while (true)
+    {
+        s = &c->slot[pos & c->mask];
+        stos_size_t seq = stos_atomic_load (&s->seq);
+        if (seq == pos)
+        {
+            if (stos_atomic_cas (&c->tail, &pos, pos + 1))
+                break;
+        }
+        else if (seq == pos - c->mask) // still holds the cell sent a lap ago: full
+            return false;
+        else
+            pos = stos_atomic_load (&c->tail);
+    }
+    s->value = v;
+    stos_atomic_store (&s->seq, pos + 1);
+    return true;
+}
+
+bool
+stos_channel_get (struct stos_channel *c, stos_cell_t *v)
+{
+    stos_size_t pos = stos_atomic_load (&c->head);
+    struct stos_channel_slot *s;
+    while (true)
+    {
+        s = &c->slot[pos & c->mask];
+        stos_size_t seq = stos_atomic_load (&s->seq);
+        if (seq == pos + 1)
+        {
+            if (stos_atomic_cas (&c->head, &pos, pos + 1))
+                break;
+        }
+        else if (seq == pos) // nothing sent to it yet: empty
+            return false;
+        else
+            pos = stos_atomic_load (&c->head);
+    }
+    *v = s->value;
+    stos_atomic_store (&s->seq, pos + c->mask + 1);
+    return true;
+}
+
+// whether a send (receive) would go through right now
+bool
+stos_channel_can (struct stos_channel *c, bool send)
+{
+    if (send)
+    {
+        stos_size_t pos = stos_atomic_load (&c->tail);
+        return stos_atomic_load (&c->slot[pos & c->mask].seq) == pos;
+    }
+    stos_size_t pos = stos_atomic_load (&c->head);
+    return stos_atomic_load (&c->slot[pos & c->mask].seq) == pos + 1;
+}
+
+// after a send or receive: threads sleeping on the other end can go on
+void
+stos_channel_moved (struct stos_channel *c)
+{
+#ifdef _STOS_THREADS
+    atomic_thread_fence (memory_order_seq_cst);
+    if (atomic_load_explicit (&c->sleepers, memory_order_relaxed))
+    {
+        pthread_mutex_lock (&c->lock);
+        pthread_cond_broadcast (&c->moved);
+        pthread_mutex_unlock (&c->lock);
+    }
+#else
+    (void)c;
+#endif
+}
+
+// cooperative multitasking. task 0 is the operator (the REPL, on the main stacks), the others
+// run on their own small stacks and only give up the cpu at `pause`, `stop` or when they return.
+// the operator runs a round of them whenever it pauses or waits for input
+
+enum stos_task_state
+{
+    TASK_STOPPED,
+    TASK_READY,
+    TASK_RUNNING,
+};
+
+struct stos_task
+{
+    stos_cell_t *dstack;
+    stos_size_t *rstack;
+    stos_size_t dsize, rsize;
+    stos_size_t dsp, rsp;
+    stos_size_t pc; // where the task resumes
+    enum stos_task_state state;
+    stos_size_t wait; // channel + 1 the task is parked on, 0 for none
+    bool wait_send;
+};
+
+STOS_TLS stos_cell_t stos_task_dstacks[MAX_TASKS - 1][TASK_DATA_STACK_SIZE];
+STOS_TLS stos_size_t stos_task_rstacks[MAX_TASKS - 1][TASK_RETURN_STACK_SIZE];
+STOS_TLS struct stos_task stos_tasks[MAX_TASKS];
+STOS_TLS stos_size_t stos_task_count = 1;
+STOS_TLS stos_size_t stos_task_cur = 0;
+STOS_TLS bool stos_yield_req = false; // set by primitives that want the running task to give up the cpu
+STOS_TLS bool stos_park_req = false;  // along with it: the primitive couldn't finish, resume the task at its call
+
+// preemption. every opcode stos_exec runs counts against stos_budget, when it runs out a background
+// task is put back in the queue where it stood, and the operator lets the tasks run (or trips the watchdog)
+STOS_TLS stos_size_t stos_task_slice = TASK_SLICE; // opcodes a task runs per turn, 0 for no preemption
+STOS_TLS stos_size_t stos_watchdog = 0;            // opcodes the operator may spend on one line, 0 for no limit
+STOS_TLS stos_size_t stos_watchdog_left;
+STOS_TLS stos_size_t stos_budget, stos_budget_granted;
+
+// host runs (stos_run). only the outermost exec of a run stops when the budget runs out - the ones
+// primitives start (catch, pdo, load) can't be left half way, they get preempted like the operator
+STOS_TLS bool stos_run_resumable = false; // the next stos_exec is a run's own
+STOS_TLS bool stos_run_stopped = false;   // it stopped at stos_run_pc
+STOS_TLS bool stos_run_pending = false;   // a run is suspended
+STOS_TLS stos_size_t stos_run_pc, stos_run_base;
+
+void
+stos_budget_grant (stos_size_t n)
+{
+    stos_budget = stos_budget_granted = n ? n : (stos_size_t)-1;
+}
+
+void
+stos_operator_grant (void)
+{
+    stos_size_t n = stos_task_slice;
+    if (stos_watchdog && (!n || n > stos_watchdog_left))
+        n = stos_watchdog_left;
+    stos_budget_grant (n);
+}
+
+// called before every line the operator runs
+void
+stos_watchdog_arm (void)
+{
+    stos_watchdog_left = stos_watchdog;
+    stos_operator_grant ();
+}
+
+void
+stos_task_switch (stos_size_t i)
+{
+    struct stos_task *t = &stos_tasks[stos_task_cur];
+    t->dsp = stos_dsp;
+    t->rsp = stos_rsp;
+
+    t = &stos_tasks[i];
+    stos_dstack = t->dstack;
+    stos_dstack_size = t->dsize;
+    stos_dsp = t->dsp;
+    stos_rstack = t->rstack;
+    stos_rstack_size = t->rsize;
+    stos_rsp = t->rsp;
+    stos_task_cur = i;
+#ifdef _STOS_MEMSTATS
+    stos_mem_slot = i != 0;
+#endif
+}
+
+void
+stos_tasks_reset (void)
+{
+    stos_tasks[0] = (struct stos_task){
+        .dstack = stos_dstack,
+        .rstack = stos_rstack,
+        .dsize = stos_dstack_size,
+        .rsize = stos_rstack_size,
+        .state = TASK_RUNNING,
+    };
+    stos_task_count = 1;
+    stos_task_cur = 0;
+    stos_yield_req = false;
+    stos_task_slice = TASK_SLICE;
+    stos_watchdog = 0;
+    stos_watchdog_arm ();
+}
+
+// runs fn in a frame of its own: whatever it throws, or a guard page hit, makes it fail instead of going further
+bool
+stos_guarded (bool (*fn) (void))
+{
+    struct stos_frame frame;
+    stos_frame_enter (&frame, false);
+    if (stos_setjmp (frame.env))
+    {
+        if (stos_thrown == STOS_THROW_BAD_ADDRESS && stos_task_cur == 0)
+            stos_dsp = 0; // it may have been the data stack guard
+        return false;
+    }
+
+    bool ok = fn ();
+    stos_frame_leave (&frame);
+    return ok;
+}
+
+// ready, and not parked on a channel that didn't move yet
+bool
+stos_task_runnable (struct stos_task *t)
+{
+    if (t->state != TASK_READY)
+        return false;
+    return !t->wait || stos_channel_can (&stos_channels[t->wait - 1], t->wait_send);
+}
+
+static bool
+stos_task_run (void)
+{
+    return stos_exec (stos_tasks[stos_task_cur].pc, 0);
+}
+
+// runs every ready background task until it yields, stops or returns.
+// a task that fails (or hits a guard page) is stopped, the others carry on
+void
+stos_tasks_round (void)
+{
+    if (stos_task_cur != 0)
+        return;
+
+    stos_size_t budget = stos_budget, granted = stos_budget_granted;
+    for (stos_size_t i = 1; i < stos_task_count; i++)
+    {
+        struct stos_task *t = &stos_tasks[i];
+        if (!stos_task_runnable (t))
+            continue;
+
+        t->state = TASK_RUNNING;
+        stos_budget_grant (stos_task_slice);
+        stos_task_switch (i);
+        bool ok = stos_guarded (stos_task_run);
+        stos_task_switch (0);
+        stos_yield_req = false;
+
+        if (!ok)
+        {
+#ifdef _STOS_INTERACTIVE
+            stos_write ("ERR. TASK ");
+            stos_putn (i);
+            stos_putc (' ');
+            stos_puts (stos_errstr);
+#endif
+            t->state = TASK_STOPPED;
+        }
+        else if (t->state == TASK_RUNNING) // returned instead of yielding
+            t->state = TASK_STOPPED;
+    }
+    stos_budget = budget;
+    stos_budget_granted = granted;
+}
+
+// takes the budget that ran out off the watchdog allowance, false when that was the last of it
+bool
+stos_watchdog_charge (void)
+{
+    if (!stos_watchdog)
+        return true;
+    if (stos_budget_granted >= stos_watchdog_left)
+    {
+        stos_seterrstr ("WATCHDOG TIMEOUT");
+        return false;
+    }
+    stos_watchdog_left -= stos_budget_granted;
+    return true;
+}
+
+// the operator used up its budget: let the tasks in, unless that was the last of its watchdog allowance
+bool
+stos_operator_preempt (void)
+{
+    if (!stos_watchdog_charge ())
+        return false;
+
+    stos_tasks_round ();
+    stos_operator_grant ();
+    return true;
+}
+
+bool
+stos_tasks_ready (void)
+{
+    for (stos_size_t i = 1; i < stos_task_count; i++)
+        if (stos_task_runnable (&stos_tasks[i]))
+            return true;
+    return false;
+}
+
+// handles a yield request once the primitive that made it is done, pc is where to resume.
+// true when the running task has to leave its exec loop
+bool
+stos_task_yield (stos_size_t pc)
+{
+    stos_yield_req = false;
+
+    if (stos_task_cur == 0)
+    {
+        stos_tasks_round ();
+        return false;
+    }
+
+    struct stos_task *t = &stos_tasks[stos_task_cur];
+    t->pc = pc;
+    if (t->state == TASK_RUNNING)
+        t->state = TASK_READY;
+    if (!stos_park_req)
+        t->wait = 0;
+    stos_park_req = false;
+    return true;
+}
+
+// what the operator does while it has nothing to do: a round of the tasks,
+// then sleeping in the HAL until input shows up (unless some task still wants the cpu)
+void
+stos_idle (void)
+{
+    stos_tasks_round ();
+    stos_poll (stos_tasks_ready () ? 0 : STOS_POLL_MS);
+}
+
+bool
+stos_task_valid (stos_cell_t task)
+{
+    if (task <= 0 || (stos_size_t)task >= stos_task_count)
+    {
+        stos_seterrstr ("INVALID TASK");
+        return false;
+    }
+    return true;
+}
+
+// runtime of `activate`: the task starts over, at pc
+bool
+stos_task_activate (stos_cell_t task, stos_size_t pc)
+{
+    if (!stos_task_valid (task))
+        return false;
+    if ((stos_size_t)task == stos_task_cur)
+    {
+        stos_seterrstr ("TASK IS RUNNING");
+        return false;
+    }
+
+    struct stos_task *t = &stos_tasks[task];
+    t->dsp = t->rsp = 0;
+    t->pc = pc;
+    t->state = TASK_READY;
+    t->wait = 0;
+    return true;
+}
+
+// the ANS codes and the messages that go with them, both ways: a primitive that returned false gets its code
+// from the message, and `throw` sets the message for a code
+static const struct
+{
+    stos_number_t code;
+    const char *msg;
+} stos_throw_codes[] = {
+    { STOS_THROW_ABORT, "ABORTED" },
+    { STOS_THROW_DSTACK_OVERFLOW, "DATA STACK OVERFLOW" },
+    { STOS_THROW_DSTACK_UNDERFLOW, "DATA STACK UNDERFLOW" },
+    { STOS_THROW_RSTACK_OVERFLOW, "RETURN STACK OVERFLOW" },
+    { STOS_THROW_RSTACK_UNDERFLOW, "RETURN STACK UNDERFLOW" },
+    { STOS_THROW_BAD_ADDRESS, "INVALID MEMORY ADDRESS" },
+    { STOS_THROW_DIVISION, "DIVISION BY ZERO" },
+    { STOS_THROW_UNDEFINED, "INVALID WORD" },
+    { STOS_THROW_TIMEOUT, "WATCHDOG TIMEOUT" },
+};
+
+#define STOS_THROW_CODES (sizeof (stos_throw_codes) / sizeof (stos_throw_codes[0]))
+
+static stos_number_t
+stos_throw_code (const char *msg)
+{
+    stos_size_t len = msg ? stos_strlen (msg) : 0;
+    for (stos_size_t i = 0; i < STOS_THROW_CODES; i++)
+        if (stos_strlen (stos_throw_codes[i].msg) == len && stos_memcmp (stos_throw_codes[i].msg, msg, len) == 0)
+            return stos_throw_codes[i].code;
+    return STOS_THROW_OTHER;
+}
+
+// turns a false return into a throw, with stos_errstr as it is. the watchdog can't be caught
+_Noreturn void
+stos_throw_error (void)
+{
+    stos_number_t code = stos_throw_code (stos_errstr);
+    if (code == STOS_THROW_TIMEOUT)
+        stos_throw_fatal (code);
+    stos_throw (code);
+}
+
+// an execution token is the word's id. this one has to name a word this VM can see
+static stos_cell_t
+stos_xt_check (stos_cell_t xt)
+{
+    stos_size_t shared = stos_words_shared (); // ids from there to stos_word_lo are other VMs'
+    if (xt >= stos_word_count || xt - shared < (stos_cell_t)(stos_word_lo - shared))
+    {
+        stos_seterrstr ("INVALID WORD");
+        stos_throw (STOS_THROW_UNDEFINED);
+    }
+    return xt;
+}
+
+// a run's slice is over, it resumes at pc
+static bool
+stos_run_stop (stos_size_t pc)
+{
+    if (!stos_watchdog_charge ())
+        stos_throw_error ();
+    stos_run_pc = pc;
+    stos_run_stopped = true;
+    return true;
+}
+
+// runs bytecode from _pc, until the RET that brings the return stack back down to base.
+// errors throw, false is left for hosts whose primitives still return it
+bool
+stos_exec (stos_size_t _pc, stos_size_t base)
+{
+    bool resumable = stos_run_resumable;
+    stos_run_resumable = false;
+
+    while (true)
+    {
+        if (--stos_budget == 0)
+        {
+            if (stos_task_cur != 0)
+                return stos_task_yield (_pc); // resumes right here on its next turn
+            if (resumable)
+                return stos_run_stop (_pc);
+            if (!stos_operator_preempt ())
+                stos_throw_error ();
+        }
+
+        uint8_t op = stos_bytecode[_pc++];
+        switch (op)
+        {
+        case OPCODE_PUSH_CELL: {
+            stos_cell_t v = stos_bc_read_addr (&_pc);
+            stos_xpush (v);
+            break;
+        }
+        case OPCODE_PUSH_VAR: {
+            stos_size_t off = stos_bc_read_uint (&_pc, SIZEOF_VAR_OFF);
+            stos_xpush (stos_addr (&stos_varspace[off]));
+            break;
+        }
+        case OPCODE_CALL_ID: {
+            stos_size_t call = _pc - SIZEOF_OPCODE;
+            stos_size_t tid = stos_bc_read_uint (&_pc, SIZEOF_WORD_ID);
+
+            if (stos_words[tid].flags & STOS_PRIMITIVE)
+            {
+                if (!stos_prim_of (tid) ())
+                    stos_throw_error ();
+                if (stos_yield_req && stos_task_yield (stos_park_req ? call : _pc))
+                    return true;
+            }
+            else
+            {
+                stos_xrpush (_pc);
+                _pc = stos_words[tid].code_off;
+            }
+            break;
+        }
+        case OPCODE_EXECUTE: {
+            stos_cell_t xt = stos_xt_check (stos_xpop ());
+            if (stos_words[xt].flags & STOS_PRIMITIVE)
+            {
+                if (!stos_prim_of (xt) ())
+                    stos_throw_error ();
+                if (stos_yield_req && stos_task_yield (_pc))
+                    return true;
+            }
+            else
+            {
+                stos_xrpush (_pc);
+                _pc = stos_words[xt].code_off;
+            }
+            break;
+        }
+        case OPCODE_PUSH_XT: {
+            stos_xpush (stos_bc_read_uint (&_pc, SIZEOF_WORD_ID));
+            break;
+        }
+        case OPCODE_RET: {
+            if (stos_rsp == base)
+                return true;
+
+            _pc = stos_xrpop ();
+            break;
+        }
+        case OPCODE_ACTIVATE: {
+            if (!stos_task_activate (stos_xpop (), _pc))
+                stos_throw_error ();
+
+            // the rest of the definition is the task's, return like `exit` does
+            if (stos_rsp == base)
+                return true;
+            _pc = stos_xrpop ();
+            break;
+        }
+        case OPCODE_PDO:
+        case OPCODE_PDO_REDUCE: {
+            stos_size_t tail = stos_bc_read_uint (&_pc, SIZEOF_BC_ADDR);
+            stos_size_t fold = (op == OPCODE_PDO_REDUCE) ? tail : 0;
+            if (!stos_pdo (_pc, fold))
+                stos_throw_error ();
+            _pc = fold ? fold + STOS_PDO_FOLD_LEN : tail;
+            break;
+        }
+        case OPCODE_JZ: {
+            stos_cell_t b = stos_xpop ();
+            stos_size_t addr = stos_bc_read_uint (&_pc, SIZEOF_BC_ADDR);
+            if (b == 0)
+                _pc = addr;
+            break;
+        }
+        case OPCODE_JNZ: {
+            stos_cell_t b = stos_xpop ();
+            stos_size_t addr = stos_bc_read_uint (&_pc, SIZEOF_BC_ADDR);
+            if (b != 0)
+                _pc = addr;
+            break;
+        }
+        case OPCODE_JMP: {
+            stos_size_t addr = stos_bc_read_uint (&_pc, SIZEOF_BC_ADDR);
+            _pc = addr;
+            break;
+        }
+        case OPCODE_DO: {
+            stos_cell_t start = stos_xpop ();
+            stos_cell_t limit = stos_xpop ();
+            stos_xrpush ((stos_size_t)limit);
+            stos_xrpush ((stos_size_t)start);
+            break;
+        }
+        case OPCODE_LOOP: {
+            stos_cell_t incr = stos_xpop ();
+            stos_size_t target = stos_bc_read_uint (&_pc, SIZEOF_BC_ADDR);
+
+            stos_size_t index = stos_rstack[stos_rsp - 1];
+            index += incr;
+            stos_rstack[stos_rsp - 1] = index;
+
+            stos_size_t limit = stos_rstack[stos_rsp - 2];
+
+            if (index < limit)
+                _pc = target;
+            else
+                stos_rsp -= 2;
+            break;
+        }
+        case OPCODE_PRINT_STR: {
+            stos_size_t len = stos_bc_read_uint (&_pc, SIZEOF_STR_LEN);
+            for (stos_size_t i = 0; i < len; i++)
+                stos_putc (stos_bytecode[_pc++]);
+            break;
+        }
+        case OPCODE_PUSH_STRING: {
+            stos_size_t len = stos_bc_read_uint (&_pc, SIZEOF_STR_LEN);
+
+            // literals are pushed in place, they are read-only. `scopy` makes a mutable copy
+            stos_xpush ((stos_cell_t)&stos_bytecode[_pc]);
+            _pc += len;
+            stos_xpush ((stos_cell_t)len);
+            break;
+        }
+#ifdef _STOS_COMPACT_BC
+        case OPCODE_PUSH_BYTE: {
+            int8_t v = (int8_t)stos_bytecode[_pc++];
+            stos_xpush ((stos_cell_t)(stos_number_t)v);
+            break;
+        }
+        case OPCODE_PUSH_SHORT: {
+            int16_t v = (int16_t)stos_bc_read_uint (&_pc, 2);
+            stos_xpush ((stos_cell_t)(stos_number_t)v);
+            break;
+        }
+        default:
+            stos_xpush ((stos_cell_t)(stos_number_t)(op - OPCODE_PUSH_SMALL - 64));
+            break;
+#endif
+        }
+    }
+
+    return true;
+}
+
+bool
+stos_word_exec (stos_size_t id)
+{
+    if (stos_words[id].flags & STOS_PRIMITIVE)
+    {
+        bool ok = stos_prim_of (id) ();
+        if (stos_yield_req) // only the operator interprets, this never leaves
+            stos_task_yield (0);
+        return ok;
+    }
+
+    return stos_exec (stos_words[id].code_off, stos_rsp);
+}
+
+// parallel loops. `pdo` runs its body once for every index, like `do`, but in no particular order:
+// the iterations are independent. under _STOS_THREADS the range is cut into chunks that a pool of workers runs,
+// each on a data stack that starts as a copy of the caller's (and on the caller's varspace). elsewhere, or when
+// it's not worth it, the caller runs them all itself. with `preduce` every iteration leaves a cell,
+// and those are combined in index order, so an associative word gives the same result either way
+
+// combines the cell the iteration left with the running result
+static bool
+stos_pdo_fold (stos_size_t fold, bool *have, stos_cell_t *acc)
+{
+    stos_cell_t v;
+    if (!stos_pop (&v))
+        return false;
+    if (*have && (!stos_push (*acc) || !stos_push (v) || !stos_exec (fold, stos_rsp) || !stos_pop (&v)))
+        return false;
+    *acc = v;
+    *have = true;
+    return true;
+}
+
+// runs the body for the indices [lo, hi) on the current stacks
+static bool
+stos_pdo_chunk (stos_size_t body, stos_size_t fold, stos_number_t lo, stos_number_t hi, bool *have, stos_cell_t *acc)
+{
+    for (stos_number_t i = lo; i < hi; i++)
+    {
+        if (!stos_rpush ((stos_size_t)hi) || !stos_rpush ((stos_size_t)i) || !stos_exec (body, stos_rsp))
+            return false;
+        stos_rsp -= 2;
+        if (fold && !stos_pdo_fold (fold, have, acc))
+            return false;
+    }
+    return true;
+}
+
+#ifdef _STOS_THREADS
+#define STOS_PDO_CHUNKS_PER_THREAD 4
+#define STOS_PDO_MAX_CHUNKS (MAX_PDO_THREADS * STOS_PDO_CHUNKS_PER_THREAD)
+
+struct stos_pdo_part
+{
+    bool ok, have;
+    stos_cell_t acc;
+    const char *err;
+    stos_number_t code; // what the chunk threw, the caller throws it again
+    bool fatal;
+};
+
+// one parallel loop. lives on the caller's C stack, the caller waits for every chunk to be done
+struct stos_pdo_job
+{
+    struct stos_pdo_job *next_job;
+    stos_size_t body, fold;
+    stos_number_t lo, hi;
+    const stos_cell_t *env; // the caller's data stack
+    stos_size_t env_len;
+    uint8_t *varspace;
+    const struct stos_arena *arenas;
+    stos_size_t word_lo, word_count; // the caller's slice of the dictionary, for xts (the shared words are global)
+    stos_size_t watchdog;
+    stos_size_t chunks, taken, done;
+    struct stos_pdo_part part[STOS_PDO_MAX_CHUNKS];
+};
+
+pthread_mutex_t stos_pdo_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stos_pdo_wake = PTHREAD_COND_INITIALIZER; // a job came in
+pthread_cond_t stos_pdo_join = PTHREAD_COND_INITIALIZER; // a job's last chunk is done
+pthread_once_t stos_pdo_once = PTHREAD_ONCE_INIT;
+struct stos_pdo_job *stos_pdo_queue = NULL;
+stos_size_t stos_pdo_threads = 0;
+
+STOS_TLS bool stos_pdo_worker = false;
+STOS_TLS stos_cell_t stos_pdo_dstack[PDO_DATA_STACK_SIZE];
+STOS_TLS struct stos_pdo_job *stos_pdo_cur;
+STOS_TLS stos_size_t stos_pdo_k;
+
+static bool
+stos_pdo_run (void)
+{
+    struct stos_pdo_job *job = stos_pdo_cur;
+    struct stos_pdo_part *part = &job->part[stos_pdo_k];
+    // in 64 bits, the range can be up to 2^32 wide and is multiplied by the chunk number
+    int64_t n = (int64_t)job->hi - job->lo;
+    stos_number_t lo = (stos_number_t)(job->lo + n * stos_pdo_k / job->chunks);
+    stos_number_t hi = (stos_number_t)(job->lo + n * (stos_pdo_k + 1) / job->chunks);
+    return stos_pdo_chunk (job->body, job->fold, lo, hi, &part->have, &part->acc);
+}
+
+// a worker takes over the caller's memory, and runs chunk k of the job on its own stacks
+static void
+stos_pdo_work (struct stos_pdo_job *job, stos_size_t k)
+{
+    stos_memcpy (stos_arenas, job->arenas, sizeof (stos_arenas));
+    stos_varspace = job->varspace;
+    stos_word_lo = job->word_lo;
+    stos_word_count = job->word_count;
+    stos_memcpy (stos_dstack, job->env, job->env_len * sizeof (stos_cell_t));
+    stos_dsp = job->env_len;
+    stos_rsp = 0;
+    stos_watchdog = job->watchdog;
+    stos_watchdog_arm ();
+
+    stos_pdo_cur = job;
+    stos_pdo_k = k;
+    struct stos_pdo_part *part = &job->part[k];
+    stos_thrown = 0;
+    stos_thrown_fatal = false;
+    part->ok = stos_guarded (stos_pdo_run);
+    part->err = stos_errstr;
+    part->code = stos_thrown ? stos_thrown : stos_throw_code (stos_errstr); // it may have failed without a throw
+    part->fatal = stos_thrown_fatal;
+}
+
+static void *
+stos_pdo_thread (void *arg)
+{
+    (void)arg;
+    stos_pdo_worker = true;
+    stos_dstack = stos_pdo_dstack;
+    stos_dstack_size = PDO_DATA_STACK_SIZE;
+    stos_rstack = stos_rstack_main;
+    stos_rstack_size = RETURN_STACK_SIZE;
+    stos_tasks_reset ();
+
+    pthread_mutex_lock (&stos_pdo_lock);
+    while (true)
+    {
+        struct stos_pdo_job *job = stos_pdo_queue;
+        if (!job)
+        {
+            pthread_cond_wait (&stos_pdo_wake, &stos_pdo_lock);
+            continue;
+        }
+
+        stos_size_t k = job->taken++;
+        if (job->taken == job->chunks)
+            stos_pdo_queue = job->next_job;
+        pthread_mutex_unlock (&stos_pdo_lock);
+
+        stos_pdo_work (job, k);
+
+        pthread_mutex_lock (&stos_pdo_lock);
+        if (++job->done == job->chunks)
+            pthread_cond_broadcast (&stos_pdo_join);
+    }
+    return NULL;
+}
+
+static void
+stos_pdo_start (void)
+{
+    long n = PDO_THREADS ? PDO_THREADS : sysconf (_SC_NPROCESSORS_ONLN);
+    if (n > MAX_PDO_THREADS)
+        n = MAX_PDO_THREADS;
+
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    for (long i = 0; i < n && n > 1; i++)
+    {
+        pthread_t t;
+        if (pthread_create (&t, &attr, stos_pdo_thread, NULL) != 0)
+            break;
+        stos_pdo_threads++;
+    }
+    pthread_attr_destroy (&attr);
+}
+
+// hands the loop to the pool and waits. false if it's not worth it, and the caller has to run it alone
+static bool
+stos_pdo_parallel (struct stos_pdo_job *job, bool *ok)
+{
+    if (stos_pdo_worker) // a nested loop: the pool is busy with the outer one
+        return false;
+    pthread_once (&stos_pdo_once, stos_pdo_start);
+
+    int64_t n = (int64_t)job->hi - job->lo;
+    if (stos_pdo_threads < 2 || n < 2)
+        return false;
+    if (stos_dsp > PDO_DATA_STACK_SIZE)
+    {
+        stos_seterrstr ("DATA STACK TOO DEEP FOR `PDO`");
+        *ok = false;
+        return true;
+    }
+
+    job->chunks = stos_pdo_threads * STOS_PDO_CHUNKS_PER_THREAD;
+    if (job->chunks > n)
+        job->chunks = (stos_size_t)n;
+    job->taken = job->done = 0;
+    job->env = stos_dstack;
+    job->env_len = stos_dsp;
+    job->varspace = stos_varspace;
+    job->arenas = stos_arenas;
+    job->word_lo = stos_word_lo;
+    job->word_count = stos_word_count;
+    job->watchdog = stos_watchdog ? stos_watchdog_left : 0;
+    for (stos_size_t k = 0; k < job->chunks; k++)
+        job->part[k] = (struct stos_pdo_part){ 0 };
+
+    pthread_mutex_lock (&stos_pdo_lock);
+    job->next_job = NULL;
+    struct stos_pdo_job **tail = &stos_pdo_queue;
+    while (*tail)
+        tail = &(*tail)->next_job;
+    *tail = job;
+    pthread_cond_broadcast (&stos_pdo_wake);
+    while (job->done < job->chunks)
+        pthread_cond_wait (&stos_pdo_join, &stos_pdo_lock);
+    pthread_mutex_unlock (&stos_pdo_lock);
+
+    // the first failing chunk decides the error, thrown with its code like a sequential loop would.
+    // the partial results are combined in order
+    bool have = false;
+    stos_cell_t acc = 0;
+    for (stos_size_t k = 0; k < job->chunks; k++)
+    {
+        struct stos_pdo_part *part = &job->part[k];
+        if (!part->ok)
+        {
+            stos_seterrstr (part->err);
+            stos_unwind (part->code, part->fatal);
+        }
+        if (part->have && (!stos_push (part->acc) || !stos_pdo_fold (job->fold, &have, &acc)))
+        {
+            *ok = false;
+            return true;
+        }
+    }
+
+    *ok = !job->fold || stos_push (have ? acc : 0);
+    return true;
+}
+#endif
+
+// runtime of `pdo` ( limit start -- ), with a fold it leaves the combined result
+bool
+stos_pdo (stos_size_t body, stos_size_t fold)
+{
+    stos_cell_t start, limit;
+    if (!stos_pop (&start) || !stos_pop (&limit))
+        return false;
+
+    // a task can't be switched out in the middle of it
+    if (stos_task_cur != 0)
+    {
+        stos_seterrstr ("`PDO` IN BACKGROUND TASK");
+        return false;
+    }
+
+#ifdef _STOS_THREADS
+    bool ok;
+    struct stos_pdo_job job = { .body = body, .fold = fold, .lo = (stos_number_t)start, .hi = (stos_number_t)limit };
+    if (stos_pdo_parallel (&job, &ok))
+        return ok;
+#endif
+
+    bool have = false;
+    stos_cell_t acc = 0;
+    if (!stos_pdo_chunk (body, fold, (stos_number_t)start, (stos_number_t)limit, &have, &acc))
+        return false;
+    return !fold || stos_push (have ? acc : 0);
+}
+
+bool
+stos_token_compile (void)
+{
+    switch (current_token.type)
+    {
+    case TOKEN_WORD: {
+        uint16_t wid;
+        if (!stos_strto_wrdid (current_token.str, current_token.len, &wid))
+        {
+            stos_seterrstr ("INVALID WORD");
+            return false;
+        }
+        else if ((stos_words[wid].flags & STOS_IMMEDIATE) && (stos_words[wid].flags & STOS_PRIMITIVE))
+            return stos_prim_of (wid) ();
+        else
+        {
+            stos_bc_emit_op (OPCODE_CALL_ID);
+            stos_bc_emit_uint (wid, SIZEOF_WORD_ID);
+            return true;
+        }
+        break;
+    }
+    case TOKEN_NUMBER: {
+        stos_bc_emit_literal ((stos_cell_t)current_token.number);
+        break;
+    }
+    default:
+        break;
+    }
+
+    return true;
+}
+
+bool
+prim_dot (void)
+{
+    stos_cell_t n;
+    if (!stos_pop (&n))
+        return false;
+    stos_putn (n);
+    stos_putc (' ');
+    return true;
+}
+
+bool
+prim_plus (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (a + b);
+    return true;
+}
+
+bool
+prim_def (void)
+{
+    stos_mode_set (MODE_COMPILE_NAME);
+    return true;
+}
+
+bool
+prim_enddef (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS || stos_scratch)
+    {
+        stos_seterrstr ("END OF DEFINITION OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_bc_emit_op (OPCODE_RET);
+    stos_word_finish (stos_word_count - 1);
+    stos_mode_set (MODE_INTERPRET);
+    return true;
+}
+
+#ifndef _STOS_NO_TOOLS
+bool
+prim_words (void)
+{
+    stos_size_t shared = stos_words_shared ();
+    for (stos_size_t i = 0; i < stos_word_count; ++i)
+    {
+        if (i == shared)
+            i = stos_word_lo;
+        if (i == stos_word_count)
+            break;
+        stos_write (stos_words[i].name);
+        stos_putc (' ');
+    }
+    stos_putc ('\r');
+    stos_putc ('\n');
+    return true;
+}
+#endif
+
+bool
+prim_swap (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (a);
+    stos_xpush (b);
+    return true;
+}
+
+bool
+prim_over (void)
+{
+    stos_xpush (stos_xpeek (1));
+    return true;
+}
+
+bool
+prim_drop (void)
+{
+    stos_xpop ();
+    return true;
+}
+
+bool
+prim_dup (void)
+{
+    stos_xpush (stos_xpeek (0));
+    return true;
+}
+
+bool
+prim_exit (void)
+{
+    stos_bc_emit_op (OPCODE_RET);
+    return true;
+}
+
+bool
+prim_minus (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (b - a);
+    return true;
+}
+
+bool
+prim_eq (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (a == b ? -1 : 0);
+    return true;
+}
+
+#ifndef _STOS_NO_CONTROL
+bool
+prim_if (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`IF` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_bc_emit_op (OPCODE_JZ);
+    stos_cpush (stos_pc);
+    stos_bc_emit_uint (0, SIZEOF_BC_ADDR); // placeholder
+    return true;
+}
+
+bool
+prim_else (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`ELSE` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_size_t if_addr;
+    if (!stos_cpop (&if_addr))
+        return false;
+
+    stos_bc_emit_op (OPCODE_JMP);
+    stos_cpush (stos_pc);
+    stos_bc_emit_uint (0, SIZEOF_BC_ADDR); // placeholder
+
+    stos_bc_patch_uint (if_addr, stos_pc, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_endif (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`THEN` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_size_t addr;
+    if (!stos_cpop (&addr))
+        return false;
+
+    stos_bc_patch_uint (addr, stos_pc, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_do (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`DO` OUTSIDE OF DEFINITION");
+        return false;
+    }
+    stos_bc_emit_op (OPCODE_DO);
+    return stos_cpush (stos_pc);
+}
+
+bool
+prim_loop (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`LOOP` OUTSIDE OF DEFINITION");
+        return false;
+    }
+    stos_bc_emit_literal (1);
+    stos_bc_emit_op (OPCODE_LOOP);
+    stos_size_t addr;
+    if (!stos_cpop (&addr))
+        return false;
+    stos_bc_emit_uint (addr, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_ploop (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`+LOOP` OUTSIDE OF DEFINITION");
+        return false;
+    }
+    stos_bc_emit_op (OPCODE_LOOP);
+    stos_size_t addr;
+    if (!stos_cpop (&addr))
+        return false;
+    stos_bc_emit_uint (addr, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_pdo (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`PDO` OUTSIDE OF DEFINITION");
+        return false;
+    }
+    stos_bc_emit_op (OPCODE_PDO);
+    if (!stos_cpush (stos_pc))
+        return false;
+    stos_bc_emit_uint (0, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_pdo_loop (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`PLOOP` OUTSIDE OF DEFINITION");
+        return false;
+    }
+    stos_size_t addr;
+    if (!stos_cpop (&addr))
+        return false;
+    stos_bc_emit_op (OPCODE_RET);
+    stos_bc_patch_uint (addr, stos_pc, SIZEOF_BC_ADDR);
+    return true;
+}
+
+// ends a `pdo` like `ploop`, the cells the iterations leave are combined with the word that follows
+bool
+prim_pdo_reduce (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`PREDUCE` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    uint16_t wid;
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+    {
+        stos_seterrstr ("EXPECTED WORD AFTER `PREDUCE`");
+        return false;
+    }
+    if (!stos_strto_wrdid (current_token.str, current_token.len, &wid))
+    {
+        stos_seterrstr ("INVALID WORD");
+        return false;
+    }
+
+    stos_size_t addr;
+    if (!stos_cpop (&addr))
+        return false;
+    stos_bc_emit_op (OPCODE_RET);
+    stos_bc_patch_uint (addr - SIZEOF_OPCODE, OPCODE_PDO_REDUCE, SIZEOF_OPCODE);
+    stos_bc_patch_uint (addr, stos_pc, SIZEOF_BC_ADDR);
+    stos_bc_emit_op (OPCODE_CALL_ID);
+    stos_bc_emit_uint (wid, SIZEOF_WORD_ID);
+    stos_bc_emit_op (OPCODE_RET);
+    return true;
+}
+#endif
+
+bool
+prim_tor (void)
+{
+    stos_xrpush (stos_xpop ());
+    return true;
+}
+
+bool
+prim_fromr (void)
+{
+    stos_xpush ((stos_number_t)stos_xrpop ());
+    return true;
+}
+
+bool
+prim_rfetch (void)
+{
+    if (stos_rsp == 0)
+    {
+        stos_seterrstr ("RETURN STACK UNDERFLOW");
+        stos_throw (STOS_THROW_RSTACK_UNDERFLOW);
+    }
+    stos_xpush ((stos_number_t)stos_rstack[stos_rsp - 1]);
+    return true;
+}
+
+bool
+prim_rot (void)
+{
+    stos_cell_t c = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_cell_t a = stos_xpop ();
+    stos_xpush (b);
+    stos_xpush (c);
+    stos_xpush (a);
+    return true;
+}
+
+#ifndef _STOS_NO_TOOLS
+bool
+prim_putstack (void)
+{
+    stos_putc ('<');
+    stos_putn (stos_dsp);
+    stos_putc ('>');
+    stos_putc (' ');
+    for (stos_size_t i = 0; i < stos_dsp; ++i)
+    {
+        stos_putn (stos_dstack[i]);
+        stos_putc (' ');
+    }
+    stos_putc ('\r');
+    stos_putc ('\n');
+    return true;
+}
+#endif
+
+bool
+prim_emit (void)
+{
+    stos_putc (stos_xpop ());
+    return true;
+}
+
+bool
+prim_mult (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (a * b);
+    return true;
+}
+
+#ifndef _STOS_NO_DIVISION
+bool
+prim_div (void)
+{
+    intptr_t a = (intptr_t)stos_xpop ();
+    intptr_t b = (intptr_t)stos_xpop ();
+    if (a == 0)
+    {
+        stos_seterrstr ("DIVISION BY ZERO");
+        stos_throw (STOS_THROW_DIVISION);
+    }
+    stos_xpush (a == -1 ? -(stos_cell_t)b : (stos_cell_t)(b / a)); // the smallest cell over -1 would trap
+    return true;
+}
+
+bool
+prim_mod (void)
+{
+    intptr_t a = (intptr_t)stos_xpop ();
+    intptr_t b = (intptr_t)stos_xpop ();
+    if (a == 0)
+    {
+        stos_seterrstr ("DIVISION BY ZERO");
+        stos_throw (STOS_THROW_DIVISION);
+    }
+    stos_xpush (a == -1 ? 0 : (stos_cell_t)(b % a)); // the smallest cell over -1 would trap
+    return true;
+}
+#endif
+
+bool
+prim_lt (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (b < a);
+    return true;
+}
+
+bool
+prim_lte (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (b <= a);
+    return true;
+}
+
+bool
+prim_gt (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (b > a);
+    return true;
+}
+
+bool
+prim_gte (void)
+{
+    stos_cell_t a = stos_xpop ();
+    stos_cell_t b = stos_xpop ();
+    stos_xpush (b >= a);
+    return true;
+}
+
+bool
+prim_fetch (void)
+{
+    stos_cell_t addr = stos_xpop ();
+    stos_xpush (*(stos_ucell_t *)stos_ptr (addr));
+    return true;
+}
+
+bool
+prim_store (void)
+{
+    stos_cell_t addr = stos_xpop ();
+    stos_cell_t value = stos_xpop ();
+    *(stos_ucell_t *)stos_ptr (addr) = value;
+    return true;
+}
+
+#ifndef _STOS_NO_MEMORY
+bool
+prim_move (void)
+{
+    stos_cell_t dest, src, u;
+    if (!stos_pop (&u))
+        return false;
+    if (!stos_pop (&dest))
+        return false;
+    if (!stos_pop (&src))
+        return false;
+
+    u = stos_span (dest, stos_span (src, u));
+    stos_memmove (stos_ptr (dest), stos_ptr (src), u);
+    return true;
+}
+
+bool
+prim_fill (void)
+{
+    stos_cell_t addr, u, byte;
+    if (!stos_pop (&byte))
+        return false;
+    if (!stos_pop (&u))
+        return false;
+    if (!stos_pop (&addr))
+        return false;
+
+    stos_memset (stos_ptr (addr), (uint8_t)byte, stos_span (addr, u));
+    return true;
+}
+
+bool
+prim_cmove (void)
+{
+    stos_cell_t dest, src, u;
+    if (!stos_pop (&u))
+        return false;
+    if (!stos_pop (&dest))
+        return false;
+    if (!stos_pop (&src))
+        return false;
+
+    uint8_t *d = stos_ptr (dest);
+    const uint8_t *s = stos_ptr (src);
+    u = stos_span (dest, stos_span (src, u));
+
+    // low-to-high, byte by byte semantics: only an overlapping dest above src needs the slow path
+    if (d > s && d < s + u)
+    {
+        while (u--)
+            *d++ = *s++;
+    }
+    else
+        stos_memcpy (d, s, u);
+    return true;
+}
+
+bool
+prim_cmove_back (void)
+{
+    stos_cell_t dest, src, u;
+    if (!stos_pop (&u))
+        return false;
+    if (!stos_pop (&dest))
+        return false;
+    if (!stos_pop (&src))
+        return false;
+
+    uint8_t *d = stos_ptr (dest);
+    const uint8_t *s = stos_ptr (src);
+    u = stos_span (dest, stos_span (src, u));
+
+    // high-to-low, byte by byte semantics: only an overlapping dest below src needs the slow path
+    if (d < s && d + u > s)
+    {
+        d += u;
+        s += u;
+        while (u--)
+            *--d = *--s;
+    }
+    else
+        stos_memcpy_back (d, s, u);
+    return true;
+}
+#endif
+
+#ifndef _STOS_NO_STRINGS
+bool
+prim_compare (void)
+{
+    stos_cell_t a1, u1, a2, u2;
+    if (!stos_pop (&u2))
+        return false;
+    if (!stos_pop (&a2))
+        return false;
+    if (!stos_pop (&u1))
+        return false;
+    if (!stos_pop (&a1))
+        return false;
+
+    u1 = stos_span (a1, u1);
+    u2 = stos_span (a2, u2);
+    int r = stos_memcmp (stos_ptr (a1), stos_ptr (a2), u1 < u2 ? u1 : u2);
+    if (r == 0)
+        r = (u1 > u2) - (u1 < u2);
+    return stos_push (r < 0 ? -1 : r > 0 ? 1 : 0);
+}
+
+bool
+prim_search (void)
+{
+    stos_cell_t a1, u1, a2, u2;
+    if (!stos_pop (&u2))
+        return false;
+    if (!stos_pop (&a2))
+        return false;
+    if (!stos_pop (&u1))
+        return false;
+    if (!stos_pop (&a1))
+        return false;
+
+    u1 = stos_span (a1, u1);
+    u2 = stos_span (a2, u2);
+    const uint8_t *p = stos_memmem (stos_ptr (a1), u1, stos_ptr (a2), u2);
+    if (!p)
+        return stos_push (a1) && stos_push (u1) && stos_push (0);
+
+    stos_cell_t off = p - (const uint8_t *)stos_ptr (a1);
+    return stos_push (stos_addr (p)) && stos_push (u1 - off) && stos_push (-1);
+}
+#endif
+
+#ifndef _STOS_NO_MEMORY
+bool
+prim_cells (void)
+{
+    stos_cell_t n;
+    if (!stos_pop (&n))
+        return false;
+
+    return stos_push (n * sizeof (stos_cell_t));
+}
+#endif
+
+bool
+prim_cfetch (void)
+{
+    stos_cell_t addr = stos_xpop ();
+    stos_xpush (*(uint8_t *)stos_ptr (addr));
+    return true;
+}
+
+bool
+prim_cstore (void)
+{
+    stos_cell_t addr = stos_xpop ();
+    stos_cell_t value = stos_xpop ();
+    *(uint8_t *)stos_ptr (addr) = (uint8_t)value;
+    return true;
+}
+
+STOS_TLS int stos_key_pending = -1; // a character `key?` has seen, but nobody took yet
+
+int
+stos_key_nb (void)
+{
+    int c = stos_key_pending;
+    if (c >= 0)
+        stos_key_pending = -1;
+    else
+        c = stos_getc_nb ();
+    return c;
+}
+
+bool
+prim_key (void)
+{
+    int c = stos_key_nb ();
+
+    // the operator keeps the tasks going, a background task blocks everything until a key comes
+    while (c < 0 && stos_task_cur == 0)
+    {
+        stos_idle ();
+        c = stos_key_nb ();
+    }
+    if (c < 0)
+        c = (uint8_t)stos_getc ();
+
+    // fprintf (stderr, "[c = 2x%02X; %c]\n", (char)c, (char)c);
+    return stos_push (c);
+}
+
+bool
+prim_keyq (void)
+{
+    if (stos_key_pending < 0)
+        stos_key_pending = stos_getc_nb ();
+    return stos_push (stos_key_pending >= 0 ? -1 : 0);
+}
+
+#ifndef _STOS_NO_CONTROL
+bool
+prim_begin (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`BEGIN` OUTSIDE OF DEFINITION");
+        return false;
+    }
+    return stos_cpush (stos_pc);
+}
+
+bool
+prim_until (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`UNTIL` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_size_t begin;
+    if (!stos_cpop (&begin))
+        return false;
+
+    stos_bc_emit_op (OPCODE_JZ);
+    stos_bc_emit_uint (begin, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_while (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`WHILE` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_bc_emit_op (OPCODE_JZ);
+    if (!stos_cpush (stos_pc))
+        return false;
+    stos_bc_emit_uint (0, SIZEOF_BC_ADDR); // placeholder
+    return true;
+}
+
+bool
+prim_repeat (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`REPEAT` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_size_t while_addr, begin_addr;
+    if (!stos_cpop (&while_addr))
+        return false;
+    if (!stos_cpop (&begin_addr))
+        return false;
+
+    stos_bc_emit_op (OPCODE_JMP);
+    stos_bc_emit_uint (begin_addr, SIZEOF_BC_ADDR);
+
+    stos_bc_patch_uint (while_addr, stos_pc, SIZEOF_BC_ADDR);
+    return true;
+}
+
+bool
+prim_again (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`AGAIN` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_size_t loop_start;
+    if (!stos_cpop (&loop_start))
+        return false;
+
+    stos_bc_emit_op (OPCODE_JMP);
+    stos_bc_emit_uint (loop_start, SIZEOF_BC_ADDR);
+
+    return true;
+}
+
+bool
+prim_recurse (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS || stos_scratch)
+    {
+        stos_seterrstr ("`RECURSE` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    stos_size_t current_word_id = stos_word_count - 1;
+    stos_bc_emit_op (OPCODE_CALL_ID);
+    stos_bc_emit_uint (current_word_id, SIZEOF_WORD_ID);
+    return true;
+}
+#endif
+
+// execution tokens are word ids
+
+bool
+prim_tick (void)
+{
+    uint16_t id;
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+    {
+        stos_seterrstr ("EXPECTED WORD AFTER `'`");
+        return false;
+    }
+    if (!stos_strto_wrdid (current_token.str, current_token.len, &id))
+    {
+        stos_seterrstr ("INVALID WORD");
+        return false;
+    }
+    return stos_push (id);
+}
+
+bool
+prim_bracket_tick (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`[']` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    uint16_t id;
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+    {
+        stos_seterrstr ("EXPECTED WORD AFTER `[']`");
+        return false;
+    }
+    if (!stos_strto_wrdid (current_token.str, current_token.len, &id))
+    {
+        stos_seterrstr ("INVALID WORD");
+        return false;
+    }
+    stos_bc_emit_op (OPCODE_PUSH_XT);
+    stos_bc_emit_uint (id, SIZEOF_WORD_ID);
+    return true;
+}
+
+// compiled, it's an opcode: a colon word runs in the caller's exec loop, and a task can be switched out of it
+bool
+prim_execute (void)
+{
+    if (stos_mode == MODE_COMPILE_TOKS)
+    {
+        stos_bc_emit_op (OPCODE_EXECUTE);
+        return true;
+    }
+    return stos_word_exec (stos_xt_check (stos_xpop ()));
+}
+
+// ( i*x xt -- j*x 0 | i*x n ) runs xt. if it throws, the stacks go back to how they were and n is what it threw
+bool
+prim_catch (void)
+{
+    stos_cell_t xt = stos_xt_check (stos_xpop ());
+
+    // the frame is on the C stack, which a task doesn't keep between its turns
+    if (stos_task_cur != 0)
+    {
+        stos_seterrstr ("`CATCH` IN BACKGROUND TASK");
+        return false;
+    }
+
+    struct stos_frame frame;
+    stos_frame_enter (&frame, true);
+    if (stos_setjmp (frame.env))
+    {
+        stos_dsp = frame.dsp;
+        stos_rsp = frame.rsp;
+        stos_csp = frame.csp;
+        stos_xpush ((stos_cell_t)stos_thrown);
+        return true;
+    }
+
+    if (!stos_word_exec (xt))
+        stos_throw_error ();
+    stos_frame_leave (&frame);
+    stos_xpush (0);
+    return true;
+}
+
+// ( n -- ) 0 does nothing
+bool
+prim_throw (void)
+{
+    stos_number_t n = (stos_number_t)stos_xpop ();
+    if (n == 0)
+        return true;
+
+    stos_seterrstr ("UNCAUGHT THROW");
+    for (stos_size_t i = 0; i < STOS_THROW_CODES; i++)
+        if (stos_throw_codes[i].code == n)
+            stos_seterrstr (stos_throw_codes[i].msg);
+    stos_throw (n);
+}
+
+bool
+prim_putstr (void)
+{
+    if (stos_mode != MODE_COMPILE_TOKS)
+    {
+        stos_seterrstr ("`.\"` OUTSIDE OF DEFINITION");
+        return false;
+    }
+
+    const char *p = stos_input_cursor;
+    const char *q = stos_memchr (p, '"', stos_input_end - p);
+    if (!q)
+    {
+        stos_seterrstr ("UNTERMINATED STRING");
+        return false;
+    }
+
+    stos_size_t len = q - p;
+    stos_input_cursor = q + 1;
+
+    if (len > STOS_BC_STR_MAX)
+    {
+        stos_seterrstr ("STRING TOO LONG");
+        return false;
+    }
+
+    stos_bc_emit_op (OPCODE_PRINT_STR);
+    stos_bc_emit_uint (len, SIZEOF_STR_LEN);
+    for (stos_size_t i = 0; i < len; i++)
+        stos_bc_emit_byte (p[i]);
+
+    return true;
+}
+
+bool
+prim_cr (void)
+{
+    stos_write ("\r\n");
+    return true;
+}
+
+bool
+prim_var (void)
+{
+    if (stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("`VARIABLE` IN DEFINITION");
+        return false;
+    }
+
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+    {
+        stos_seterrstr ("EXPECTED WORD AFTER `VARIABLE`");
+        return false;
+    }
+
+    if (stos_vsp + sizeof (stos_cell_t) > stos_vsp_hi)
+    {
+        stos_seterrstr ("VARIABLE SPACE AT CAPACITY");
+        return false;
+    }
+
+    stos_size_t var_off = stos_vsp;
+
+    stos_ssize_t id = stos_word_create (current_token.str, current_token.len, 0);
+    if (id < 0)
+        return false;
+
+    stos_vsp += sizeof (stos_cell_t);
+    stos_memset (&stos_varspace[var_off], 0, sizeof (stos_cell_t));
+
+    stos_bc_emit_op (OPCODE_PUSH_VAR);
+    stos_bc_emit_uint (var_off, SIZEOF_VAR_OFF);
+    stos_bc_emit_op (OPCODE_RET);
+    stos_word_finish (id);
+
+    return true;
+}
+
+bool
+prim_constant (void)
+{
+    if (stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("`CONSTANT` IN DEFINITION");
+        return false;
+    }
+
+    stos_cell_t value;
+    if (!stos_pop (&value))
+        return false;
+
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+    {
+        stos_seterrstr ("EXPECTED WORD AFTER `CONSTANT`");
+        return false;
+    }
+
+    stos_ssize_t id = stos_word_create (current_token.str, current_token.len, 0);
+    if (id < 0)
+        return false;
+
+    stos_bc_emit_literal (value);
+    stos_bc_emit_op (OPCODE_RET);
+    stos_word_finish (id);
+
+    return true;
+}
+
+#ifndef _STOS_NO_MEMORY
+bool
+prim_create (void)
+{
+    if (stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("`CREATE` IN DEFINITION");
+        return false;
+    }
+
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+        return false;
+
+    stos_size_t var_off = stos_vsp;
+
+    stos_ssize_t id = stos_word_create (current_token.str, current_token.len, 0);
+    if (id < 0)
+        return false;
+
+    stos_bc_emit_op (OPCODE_PUSH_VAR);
+    stos_bc_emit_uint (var_off, SIZEOF_VAR_OFF);
+    stos_bc_emit_op (OPCODE_RET);
+    stos_word_finish (id);
+
+    return true;
+}
+
+bool
+prim_allot (void)
+{
+    if (stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("`ALLOT` IN DEFINITION");
+        return false;
+    }
+
+    stos_cell_t n;
+    if (!stos_pop (&n))
+        return false;
+
+    if (stos_vsp + n > stos_vsp_hi)
+    {
+        stos_seterrstr ("VARIABLE SPACE AT CAPACITY");
+        return false;
+    }
+
+    stos_vsp += n;
+    return true;
+}
+#endif
+
+#ifndef _STOS_NO_STRINGS
+bool
+prim_squote (void)
+{
+    const char *str_start = stos_skip_space (stos_input_cursor, stos_input_end);
+    const char *q = stos_memchr (str_start, '"', stos_input_end - str_start);
+    if (!q)
+    {
+        stos_seterrstr ("UNTERMINATED STRING");
+        return false;
+    }
+
+    stos_size_t len = q - str_start;
+    stos_input_cursor = q + 1;
+
+    if (stos_mode == MODE_INTERPRET)
+    {
+        char *str = stos_str_alloc (len);
+        if (!str)
+            return false;
+
+        stos_memcpy (str, str_start, len);
+
+        if (!stos_push (stos_addr (str)))
+            return false;
+
+        return stos_push ((stos_cell_t)len);
+    }
+    else if (stos_mode == MODE_COMPILE_TOKS)
+    {
+        if (len > STOS_BC_STR_MAX)
+        {
+            stos_seterrstr ("STRING TOO LONG");
+            return false;
+        }
+
+#ifdef _STOS_SANDBOX
+        // the bytecode isn't addressable from FORTH, the literal goes to varspace instead
+        if (stos_vsp + len > stos_vsp_hi)
+        {
+            stos_seterrstr ("VARIABLE SPACE AT CAPACITY");
+            return false;
+        }
+        stos_memcpy (&stos_varspace[stos_vsp], str_start, len);
+        stos_bc_emit_op (OPCODE_PUSH_VAR);
+        stos_bc_emit_uint (stos_vsp, SIZEOF_VAR_OFF);
+        stos_bc_emit_literal (len);
+        stos_vsp += len;
+#else
+        stos_bc_emit_op (OPCODE_PUSH_STRING);
+        stos_bc_emit_uint (len, SIZEOF_STR_LEN);
+
+        for (stos_size_t i = 0; i < len; i++)
+        {
+            stos_bc_emit_byte (str_start[i]);
+        }
+#endif
+
+        return true;
+    }
+
+    return false;
+}
+
+bool
+prim_type (void)
+{
+    stos_cell_t len, addr;
+    if (!stos_pop (&len) || !stos_pop (&addr))
+        return false;
+
+    const char *str = stos_ptr (addr);
+    len = stos_span (addr, len);
+    for (stos_size_t i = 0; i < len; i++)
+        stos_putc (str[i]);
+
+    return true;
+}
+
+bool
+prim_scopy (void)
+{
+    stos_cell_t len, addr;
+    if (!stos_pop (&len) || !stos_pop (&addr))
+        return false;
+    if (len != (stos_size_t)len)
+    {
+        stos_seterrstr ("STRING TOO LONG");
+        return false;
+    }
+
+    char *str = stos_str_alloc (len);
+    if (!str)
+        return false;
+
+    stos_memcpy (str, stos_ptr (addr), stos_span (addr, len));
+    if (!stos_push (stos_addr (str)))
+        return false;
+    return stos_push (len);
+}
+#endif
+
+#ifndef _STOS_NO_MEMORY
+bool
+prim_cellp (void)
+{
+    stos_cell_t addr;
+    if (!stos_pop (&addr))
+        return false;
+
+    return stos_push (addr + sizeof (stos_cell_t));
+}
+#endif
+
+#ifndef _STOS_NO_CONTROL
+bool
+prim_i (void)
+{
+    if (stos_rsp < 2)
+    {
+        stos_seterrstr ("`I` OUTSIDE OF DO LOOP");
+        return false;
+    }
+
+    stos_xpush ((stos_number_t)stos_rstack[stos_rsp - 1]);
+    return true;
+}
+#endif
+
+#ifndef _STOS_NO_MEMORY
+// array (dsp) words. arrays are `n cells` long buffers, usually made with `create` / `allot`.
+// kernels are plain loops over cells, left to the compiler's vectorizer. no restrict: `a a a n v+` and
+// `x k x n vscale` work in place, and the vectorizer checks for overlap at run time.
+// add, mul and dot wrap around like `+` and `*` do; min and max compare as stos_number_t
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("tree-vectorize") // gcc only vectorizes the cheapest loops at -O2
+#endif
+
+static void
+stos_vec_add (const stos_ucell_t *a, const stos_ucell_t *b, stos_ucell_t *y, stos_size_t n)
+{
+    for (stos_size_t i = 0; i < n; i++)
+        y[i] = a[i] + b[i];
+}
+
+static void
+stos_vec_mul (const stos_ucell_t *a, const stos_ucell_t *b, stos_ucell_t *y, stos_size_t n)
+{
+    for (stos_size_t i = 0; i < n; i++)
+        y[i] = a[i] * b[i];
+}
+
+static void
+stos_vec_scale (const stos_ucell_t *a, stos_cell_t k, stos_ucell_t *y, stos_size_t n)
+{
+    for (stos_size_t i = 0; i < n; i++)
+        y[i] = a[i] * k;
+}
+
+// y += k * x
+static void
+stos_vec_axpy (const stos_ucell_t *x, stos_cell_t k, stos_ucell_t *y, stos_size_t n)
+{
+    for (stos_size_t i = 0; i < n; i++)
+        y[i] += x[i] * k;
+}
+
+static stos_cell_t
+stos_vec_dot (const stos_ucell_t *a, const stos_ucell_t *b, stos_size_t n)
+{
+    stos_cell_t acc = 0;
+    for (stos_size_t i = 0; i < n; i++)
+        acc += a[i] * b[i];
+    return acc;
+}
+
+static stos_cell_t
+stos_vec_sum (const stos_ucell_t *a, stos_size_t n)
+{
+    stos_cell_t acc = 0;
+    for (stos_size_t i = 0; i < n; i++)
+        acc += a[i];
+    return acc;
+}
+
+static stos_number_t
+stos_vec_min (const stos_ucell_t *a, stos_size_t n)
+{
+    stos_number_t m = (stos_number_t)a[0];
+    for (stos_size_t i = 1; i < n; i++)
+    {
+        stos_number_t v = (stos_number_t)a[i];
+        m = v < m ? v : m;
+    }
+    return m;
+}
+
+static stos_number_t
+stos_vec_max (const stos_ucell_t *a, stos_size_t n)
+{
+    stos_number_t m = (stos_number_t)a[0];
+    for (stos_size_t i = 1; i < n; i++)
+    {
+        stos_number_t v = (stos_number_t)a[i];
+        m = v > m ? v : m;
+    }
+    return m;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+// elementwise binary op ( a1 a2 a3 n -- )
+static bool
+stos_vec_binop (void (*kernel) (const stos_ucell_t *, const stos_ucell_t *, stos_ucell_t *, stos_size_t))
+{
+    stos_cell_t a, b, y, n;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&y))
+        return false;
+    if (!stos_pop (&b))
+        return false;
+    if (!stos_pop (&a))
+        return false;
+
+    n = stos_cells (a, stos_cells (b, stos_cells (y, n)));
+    kernel (stos_ptr (a), stos_ptr (b), stos_ptr (y), n);
+    return true;
+}
+
+bool
+prim_vadd (void)
+{
+    return stos_vec_binop (stos_vec_add);
+}
+
+bool
+prim_vmul (void)
+{
+    return stos_vec_binop (stos_vec_mul);
+}
+
+bool
+prim_vscale (void)
+{
+    stos_cell_t a, k, y, n;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&y))
+        return false;
+    if (!stos_pop (&k))
+        return false;
+    if (!stos_pop (&a))
+        return false;
+
+    n = stos_cells (a, stos_cells (y, n));
+    stos_vec_scale (stos_ptr (a), k, stos_ptr (y), n);
+    return true;
+}
+
+bool
+prim_vdot (void)
+{
+    stos_cell_t a, b, n;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&b))
+        return false;
+    if (!stos_pop (&a))
+        return false;
+
+    n = stos_cells (a, stos_cells (b, n));
+    return stos_push (stos_vec_dot (stos_ptr (a), stos_ptr (b), n));
+}
+
+bool
+prim_vsum (void)
 {
-    stos_words[id].code_len = stos_pc - stos_words[id].code_off;
+    stos_cell_t a, n;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&a))
+        return false;
+
+    return stos_push (stos_vec_sum (stos_ptr (a), stos_cells (a, n)));
 }
 
 bool
-stos_primitive_compile (const char *name, stos_primitive_fn fn, uint8_t flags)
+prim_vmin (void)
 {
-    if (stos_prim_count >= MAX_PRIMITIVES)
+    stos_cell_t a, n;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&a))
+        return false;
+
+    n = stos_cells (a, n);
+    if (n == 0)
     {
-        stos_seterrstr ("PRIMITIVES AT CAPACITY");
+        stos_seterrstr ("EMPTY ARRAY");
         return false;
     }
+    return stos_push (stos_vec_min (stos_ptr (a), n));
+}
 
-    stos_ssize_t id = stos_word_create (name, flags | STOS_PRIMITIVE);
-    if (id < 0)
+bool
+prim_vmax (void)
+{
+    stos_cell_t a, n;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&a))
         return false;
 
-    stos_prims[id] = fn;
-    stos_bc_emit_op (OPCODE_CALL_ID);
-    stos_bc_emit_size (id);
-    stos_bc_emit_op (OPCODE_RET);
-    stos_word_finish (id);
-    return true;
+    n = stos_cells (a, n);
+    if (n == 0)
+    {
+        stos_seterrstr ("EMPTY ARRAY");
+        return false;
+    }
+    return stos_push (stos_vec_max (stos_ptr (a), n));
+}
+
+// outputs of a sliding window of w cells (w > 0) that fit in memory, for input at x and output at y
+static stos_cell_t
+stos_window_fit (stos_cell_t x, stos_cell_t y, stos_cell_t n, stos_cell_t w)
+{
+    n = stos_cells (y, n);
+    if (n > (stos_cell_t)-1 - (w - 1))
+        n = (stos_cell_t)-1 - (w - 1);
+    stos_cell_t nx = stos_cells (x, n + w - 1);
+    if (nx < n + w - 1)
+        n = nx >= w ? nx - w + 1 : 0;
+    return n;
 }
 
+// ( x h y n taps -- ) y[i] = h[0]*x[i+taps-1] + ... + h[taps-1]*x[i], for i < n.
+// x holds n+taps-1 samples, oldest first. computed tap by tap, so the inner loop is a contiguous axpy
 bool
-stos_strto_wrdid (const char *str, uint16_t *out_id)
+prim_fir (void)
 {
-    for (int i = 0; i < stos_word_count; ++i)
+    stos_cell_t x, h, y, n, taps;
+    if (!stos_pop (&taps))
+        return false;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&y))
+        return false;
+    if (!stos_pop (&h))
+        return false;
+    if (!stos_pop (&x))
+        return false;
+
+    const stos_ucell_t *xs = stos_ptr (x);
+    const stos_ucell_t *hs = stos_ptr (h);
+    stos_ucell_t *ys = stos_ptr (y);
+
+    taps = stos_cells (h, taps);
+    if (taps == 0)
     {
-        if (stos_strcasesame (str, stos_words[i].name))
-        {
-            *out_id = i;
-            return true;
-        }
+        stos_seterrstr ("EMPTY ARRAY");
+        return false;
     }
-    return false;
+    n = stos_window_fit (x, y, n, taps);
+
+    stos_vec_scale (xs + taps - 1, hs[0], ys, n);
+    for (stos_size_t k = 1; k < taps; k++)
+        stos_vec_axpy (xs + taps - 1 - k, hs[k], ys, n);
+    return true;
 }
 
+// ( x y n w -- ) y[i] = (x[i] + ... + x[i+w-1]) / w, for i < n. x holds n+w-1 samples
 bool
-stos_word_exec (stos_size_t id)
+prim_movavg (void)
 {
-    if (stos_words[id].flags & STOS_PRIMITIVE)
-        return stos_prims[id]();
-    else
+    stos_cell_t x, y, n, w;
+    if (!stos_pop (&w))
+        return false;
+    if (!stos_pop (&n))
+        return false;
+    if (!stos_pop (&y))
+        return false;
+    if (!stos_pop (&x))
+        return false;
+
+    const stos_ucell_t *xs = stos_ptr (x);
+    stos_ucell_t *ys = stos_ptr (y);
+
+    w = stos_cells (x, w);
+    if (w == 0)
     {
-        stos_size_t _pc = stos_words[id].code_off;
+        stos_seterrstr ("EMPTY ARRAY");
+        return false;
+    }
+    n = stos_window_fit (x, y, n, w);
+    if (n == 0)
+        return true;
 
-        while (true)
-        {
-            uint8_t op = stos_bytecode[_pc++];
-            switch (op)
-            {
-            case OPCODE_PUSH_CELL: {
-                stos_cell_t v = stos_bc_read_addr (&_pc);
-                stos_push (v);
-                break;
-            }
-            case OPCODE_CALL_ID: {
-                stos_size_t tid = stos_bc_read_size (&_pc);
-
-                if (stos_words[tid].flags & STOS_PRIMITIVE)
-                    stos_prims[tid]();
-                else
-                {
-                    stos_rpush (_pc);
-                    _pc = stos_words[tid].code_off;
-                }
-                break;
-            }
-            case OPCODE_RET: {
-                if (stos_rsp == 0)
-                    return true;
+    // running sum, O(n) regardless of the window
+    stos_number_t acc = (stos_number_t)stos_vec_sum (xs, w - 1);
+    for (stos_size_t i = 0; i < n; i++)
+    {
+        acc += (stos_number_t)xs[i + w - 1];
+        ys[i] = (stos_cell_t)(acc / (stos_number_t)w);
+        acc -= (stos_number_t)xs[i];
+    }
+    return true;
+}
+#endif
 
-                if (!stos_rpop (&_pc))
-                    return false;
-                break;
-            }
-            case OPCODE_JZ: {
-                stos_cell_t b;
-                if (!stos_pop (&b))
-                    return false;
-                stos_size_t addr = stos_bc_read_size (&_pc);
-                if (b == 0)
-                    _pc = addr;
-                break;
-            }
-            case OPCODE_JNZ: {
-                stos_cell_t b;
-                if (!stos_pop (&b))
-                    return false;
-                stos_size_t addr = stos_bc_read_size (&_pc);
-                if (b != 0)
-                    _pc = addr;
-                break;
-            }
-            case OPCODE_JMP: {
-                stos_size_t addr = stos_bc_read_size (&_pc);
-                _pc = addr;
-                break;
-            }
-            case OPCODE_DO: {
+#if defined(_STOS_MMAP) && !defined(_STOS_SANDBOX) && !defined(_STOS_NO_FILES)
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 
-                stos_cell_t start;
-                if (!stos_pop (&start))
-                    return false;
-                stos_cell_t limit;
-                if (!stos_pop (&limit))
-                    return false;
+// mapped files. `map-file` gives the bytes of a file at an address every memory word takes, nothing is copied:
+// pages come in from the page cache as they're touched. the mapping is private, stores only change the memory.
+// `map-file-rw` maps it shared instead, so stores reach the file (`sync-file` waits for them to get there).
+// the sandbox has no addresses outside its varspace, it doesn't get these words
 
-                stos_rpush ((stos_size_t)limit);
-                stos_rpush ((stos_size_t)start);
-                break;
-            }
-            case OPCODE_LOOP: {
-                stos_cell_t incr;
-                if (!stos_pop (&incr))
-                    return false;
-                stos_size_t target = stos_bc_read_size (&_pc);
-
-                stos_size_t index = stos_rstack[stos_rsp - 1];
-                index += incr;
-                stos_rstack[stos_rsp - 1] = index;
-
-                stos_size_t limit = stos_rstack[stos_rsp - 2];
-
-                if (index < limit)
-                    _pc = target;
-                else
-                    stos_rsp -= 2;
-                break;
-            }
-            case OPCODE_PRINT_STR: {
-                stos_size_t len = stos_bc_read_size (&_pc);
-                for (stos_size_t i = 0; i < len; i++)
-                    stos_putc (stos_bytecode[_pc++]);
-                break;
-            }
-            case OPCODE_PUSH_STRING: {
-                stos_size_t len = stos_bc_read_size (&_pc);
+struct stos_mapping
+{
+    uint8_t *base;
+    size_t len;
+    bool shared;
+};
+
+STOS_TLS struct stos_mapping stos_mappings[MAX_MAPPED_FILES];
 
-                stos_cell_t addr = (stos_cell_t)&stos_bytecode[_pc];
-                // stos_push (addr);
+// copies a FORTH string into path, with the terminator C wants
+bool
+stos_path (stos_cell_t addr, stos_cell_t len, char *path)
+{
+    if (len >= PATH_MAX)
+    {
+        stos_seterrstr ("PATH TOO LONG");
+        return false;
+    }
+    stos_memcpy (path, stos_ptr (addr), len);
+    path[len] = '\0';
+    return true;
+}
 
-                _pc += len;
+// the mapping addr is in (with all of len after it), NULL if there's none
+static struct stos_mapping *
+stos_mapping_of (stos_cell_t addr, stos_cell_t len)
+{
+    for (int i = 0; i < MAX_MAPPED_FILES; i++)
+    {
+        struct stos_mapping *m = &stos_mappings[i];
+        if (!m->base || addr < (stos_cell_t)m->base)
+            continue;
+        stos_cell_t off = addr - (stos_cell_t)m->base;
+        if (off <= m->len && len <= m->len - off)
+            return m;
+    }
+    stos_seterrstr ("NOT A MAPPED FILE");
+    return NULL;
+}
 
-                // stos_push ((stos_cell_t)len);
+static bool
+stos_map_file (bool shared)
+{
+    stos_cell_t addr, len;
+    if (!stos_pop (&len) || !stos_pop (&addr))
+        return false;
 
-                stos_memcpy (stos_string + stos_strp, (char *)addr, len);
-                stos_string[stos_strp + len] = '\0';
+    char path[PATH_MAX];
+    if (!stos_path (addr, len, path))
+        return false;
 
-                if (!stos_push ((stos_cell_t)stos_string + stos_strp))
-                    return false;
+    struct stos_mapping *m = NULL;
+    for (int i = 0; i < MAX_MAPPED_FILES && !m; i++)
+        if (!stos_mappings[i].base)
+            m = &stos_mappings[i];
+    if (!m)
+    {
+        stos_seterrstr ("TOO MANY MAPPED FILES");
+        return false;
+    }
 
-                stos_strp += len + 1;
+    int fd = open (path, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        stos_seterrstr ("CAN'T OPEN FILE");
+        return false;
+    }
 
-                return stos_push ((stos_cell_t)len);
-            }
-            }
-        }
+    // an empty file has nothing to map, it's 0 0
+    struct stat st;
+    uint8_t *p = NULL;
+    bool ok = fstat (fd, &st) == 0;
+    if (ok && st.st_size > 0)
+    {
+        p = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        ok = p != MAP_FAILED;
+    }
+    close (fd);
+    if (!ok)
+    {
+        stos_seterrstr ("CAN'T MAP FILE");
+        return false;
+    }
+
+    if (p)
+    {
+        madvise (p, st.st_size, MADV_SEQUENTIAL); // mostly scanned front to back: read ahead, drop behind
+        *m = (struct stos_mapping){ p, st.st_size, shared };
+    }
+    return stos_push ((stos_cell_t)p) && stos_push (p ? (stos_cell_t)st.st_size : 0);
+}
+
+// ( c-addr u -- addr len )
+bool
+prim_map_file (void)
+{
+    return stos_map_file (false);
+}
+
+// ( c-addr u -- addr len )
+bool
+prim_map_file_rw (void)
+{
+    return stos_map_file (true);
+}
 
+// ( addr len -- ) writes the changed pages of the range back to the file, and waits for them
+bool
+prim_sync_file (void)
+{
+    stos_cell_t addr, len;
+    if (!stos_pop (&len) || !stos_pop (&addr))
+        return false;
+
+    struct stos_mapping *m = stos_mapping_of (addr, len);
+    if (!m)
+        return false;
+    if (!m->shared || len == 0)
         return true;
+
+    stos_cell_t from = addr / stos_page_size * stos_page_size;
+    if (msync ((void *)from, addr + len - from, MS_SYNC) != 0)
+    {
+        stos_seterrstr ("CAN'T SYNC FILE");
+        return false;
     }
+    return true;
 }
 
+// ( addr len -- ) takes what map-file returned
 bool
-stos_token_compile (void)
+prim_unmap_file (void)
 {
-    switch (current_token.type)
+    stos_cell_t addr, len;
+    if (!stos_pop (&len) || !stos_pop (&addr))
+        return false;
+    if (addr == 0 && len == 0)
+        return true;
+
+    struct stos_mapping *m = stos_mapping_of (addr, len);
+    if (!m)
+        return false;
+    if ((uint8_t *)addr != m->base || len != m->len)
     {
-    case TOKEN_WORD: {
-        uint16_t wid;
-        if (!stos_strto_wrdid (current_token.str, &wid))
+        stos_seterrstr ("NOT A MAPPED FILE");
+        return false;
+    }
+
+    bool ok = !m->shared || msync (m->base, m->len, MS_SYNC) == 0;
+    munmap (m->base, m->len);
+    m->base = NULL;
+    if (!ok)
+        stos_seterrstr ("CAN'T SYNC FILE");
+    return ok;
+}
+
+// streaming files, the ANS file words. every open file has a read-ahead and a write-behind buffer of
+// FILE_BUFFER_SIZE bytes, so line after line (or small write after small write) costs a syscall per buffer,
+// not per call. reads or writes bigger than the buffer go straight to the file. iors are errno values, 0 is success.
+// `next-line` is `read-line` without the copy: it gives the line where it sits in the read-ahead buffer
+
+#include <errno.h>
+
+struct stos_file
+{
+    int fd; // -1 while the slot is free
+    uint8_t *rbuf, *wbuf;
+    size_t rpos, rlen, wlen;
+};
+
+STOS_TLS struct stos_file stos_files[MAX_OPEN_FILES];
+STOS_TLS bool stos_files_init = false;
+
+// fileids are slot + 1
+static struct stos_file *
+stos_file_of (stos_cell_t id)
+{
+    if (!stos_files_init || id == 0 || id > MAX_OPEN_FILES || stos_files[id - 1].fd < 0)
+    {
+        stos_seterrstr ("INVALID FILE");
+        return NULL;
+    }
+    return &stos_files[id - 1];
+}
+
+static int
+stos_file_write_all (int fd, const uint8_t *src, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = write (fd, src + done, len - done);
+        if (n < 0 && errno != EINTR)
+            return errno;
+        if (n > 0)
+            done += n;
+    }
+    return 0;
+}
+
+static int
+stos_file_wflush (struct stos_file *f)
+{
+    int err = stos_file_write_all (f->fd, f->wbuf, f->wlen);
+    f->wlen = 0;
+    return err;
+}
+
+// read-ahead that wasn't used goes back, so the file position is where the program thinks it is
+static int
+stos_file_unread (struct stos_file *f)
+{
+    if (f->rpos < f->rlen && lseek (f->fd, -(off_t)(f->rlen - f->rpos), SEEK_CUR) < 0)
+        return errno;
+    f->rpos = f->rlen = 0;
+    return 0;
+}
+
+// refills the read-ahead buffer behind what's left in it. 0 at the end of the file, -1 on error
+static ssize_t
+stos_file_fill (struct stos_file *f)
+{
+    if (f->rpos)
+    {
+        stos_memmove (f->rbuf, f->rbuf + f->rpos, f->rlen - f->rpos);
+        f->rlen -= f->rpos;
+        f->rpos = 0;
+    }
+
+    ssize_t n;
+    do
+        n = read (f->fd, f->rbuf + f->rlen, FILE_BUFFER_SIZE - f->rlen);
+    while (n < 0 && errno == EINTR);
+    if (n > 0)
+        f->rlen += n;
+    return n;
+}
+
+// the next line (of at most max bytes) as a span of the read-ahead buffer, without its newline.
+// returns 1, 0 at the end of the file (even for max 0), or -1 on error
+static int
+stos_file_line (struct stos_file *f, size_t max, const uint8_t **line, size_t *len)
+{
+    if (f->wlen && stos_file_wflush (f))
+        return -1;
+
+    size_t scanned = 0;
+    while (true)
+    {
+        const uint8_t *start = f->rbuf + f->rpos;
+        size_t avail = f->rlen - f->rpos;
+        size_t upto = avail < max ? avail : max;
+        const uint8_t *nl = stos_memchr (start + scanned, '\n', upto - scanned);
+        if (nl || (avail && avail >= max) || (avail && f->rlen == FILE_BUFFER_SIZE && f->rpos == 0))
         {
-            stos_seterrstr ("INVALID WORD");
-            return false;
+            *line = start;
+            *len = nl ? (size_t)(nl - start) : upto;
+            f->rpos += *len + (nl != NULL);
+            return 1;
         }
-        else if ((stos_words[wid].flags & STOS_IMMEDIATE) && (stos_words[wid].flags & STOS_PRIMITIVE))
-            return stos_prims[wid]();
-        else
+        scanned = upto;
+
+        ssize_t n = stos_file_fill (f);
+        if (n < 0)
+            return -1;
+        if (n == 0)
         {
-            stos_bc_emit_op (OPCODE_CALL_ID);
-            stos_bc_emit_size (wid);
-            return true;
+            if (!avail)
+                return 0;
+            *line = f->rbuf + f->rpos; // the last line has no newline
+            *len = avail;
+            f->rpos += avail;
+            return 1;
         }
-        break;
-    }
-    case TOKEN_NUMBER: {
-        stos_bc_emit_op (OPCODE_PUSH_CELL);
-        stos_bc_emit_addr (current_token.number);
-        break;
-    }
-    default:
-        break;
     }
+}
 
-    return true;
+bool
+prim_ro (void)
+{
+    return stos_push (O_RDONLY);
 }
 
 bool
-prim_dot (void)
+prim_wo (void)
 {
-    stos_cell_t n;
-    if (!stos_pop (&n))
-        return false;
-    stos_putn (n);
-    stos_putc (' ');
-    return true;
+    return stos_push (O_WRONLY);
 }
 
 bool
-prim_plus (void)
+prim_rw (void)
+{
+    return stos_push (O_RDWR);
+}
+
+static bool
+stos_file_open (int flags)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a) || !stos_pop (&b))
+    stos_cell_t addr, len, fam;
+    if (!stos_pop (&fam) || !stos_pop (&len) || !stos_pop (&addr))
+        return false;
+
+    char path[PATH_MAX];
+    if (!stos_path (addr, len, path))
         return false;
-    return stos_push (a + b);
+
+    if (!stos_files_init)
+    {
+        for (int i = 0; i < MAX_OPEN_FILES; i++)
+            stos_files[i].fd = -1;
+        stos_files_init = true;
+    }
+    int slot = 0;
+    while (slot < MAX_OPEN_FILES && stos_files[slot].fd >= 0)
+        slot++;
+    if (slot == MAX_OPEN_FILES)
+        return stos_push (0) && stos_push (EMFILE);
+
+    uint8_t *bufs = mmap (NULL, 2 * FILE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED)
+        return stos_push (0) && stos_push (ENOMEM);
+
+    int fd = open (path, (int)(fam & O_ACCMODE) | flags, 0666);
+    if (fd < 0)
+    {
+        int err = errno;
+        munmap (bufs, 2 * FILE_BUFFER_SIZE);
+        return stos_push (0) && stos_push (err);
+    }
+
+    stos_files[slot] = (struct stos_file){ fd, bufs, bufs + FILE_BUFFER_SIZE, 0, 0, 0 };
+    return stos_push (slot + 1) && stos_push (0);
 }
 
+// ( c-addr u fam -- fileid ior )
 bool
-prim_def (void)
+prim_open_file (void)
 {
-    stos_mode_set (MODE_COMPILE_NAME);
-    return true;
+    return stos_file_open (0);
 }
 
+// ( c-addr u fam -- fileid ior ) an empty file, whether it existed or not
 bool
-prim_enddef (void)
+prim_create_file (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("END OF DEFINITION OUTSIDE OF DEFINITION");
-        return false;
-    }
+    return stos_file_open (O_CREAT | O_TRUNC);
+}
 
-    stos_bc_emit_op (OPCODE_RET);
-    stos_word_finish (stos_word_count - 1);
-    stos_mode_set (MODE_INTERPRET);
-    return true;
+// ( fileid -- ior )
+bool
+prim_close_file (void)
+{
+    stos_cell_t id;
+    if (!stos_pop (&id))
+        return false;
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
+        return false;
+
+    int err = stos_file_wflush (f);
+    if (close (f->fd) != 0 && !err)
+        err = errno;
+    munmap (f->rbuf, 2 * FILE_BUFFER_SIZE);
+    f->fd = -1;
+    return stos_push (err);
 }
 
+// ( c-addr u1 fileid -- u2 ior ) u2 is less than u1 only at the end of the file
 bool
-prim_words (void)
+prim_read_file (void)
 {
-    for (int i = 0; i < stos_word_count; ++i)
+    stos_cell_t addr, len, id;
+    if (!stos_pop (&id) || !stos_pop (&len) || !stos_pop (&addr))
+        return false;
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
+        return false;
+
+    int err = f->wlen ? stos_file_wflush (f) : 0;
+    uint8_t *dest = stos_ptr (addr);
+    len = stos_span (addr, len);
+    size_t got = 0;
+    while (!err && got < len)
     {
-        stos_write (stos_words[i].name);
-        stos_putc (' ');
+        size_t avail = f->rlen - f->rpos;
+        if (avail)
+        {
+            size_t n = avail < len - got ? avail : len - got;
+            stos_memcpy (dest + got, f->rbuf + f->rpos, n);
+            f->rpos += n;
+            got += n;
+            continue;
+        }
+
+        ssize_t n;
+        if (len - got >= FILE_BUFFER_SIZE) // wouldn't fit the buffer anyway
+        {
+            n = read (f->fd, dest + got, len - got);
+            if (n > 0)
+                got += n;
+        }
+        else
+            n = stos_file_fill (f);
+
+        if (n < 0 && errno != EINTR)
+            err = errno;
+        if (n == 0)
+            break;
     }
-    stos_putc ('\r');
-    stos_putc ('\n');
-    return true;
+    return stos_push (got) && stos_push (err);
 }
 
+// ( c-addr u1 fileid -- u2 flag ior ) reads a line of at most u1 characters, without the newline.
+// flag is false at the end of the file
 bool
-prim_swap (void)
+prim_read_line (void)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
+    stos_cell_t addr, len, id;
+    if (!stos_pop (&id) || !stos_pop (&len) || !stos_pop (&addr))
         return false;
-    if (!stos_push (a))
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
         return false;
-    return stos_push (b);
+
+    const uint8_t *line;
+    size_t n;
+    len = stos_span (addr, len);
+    int r = stos_file_line (f, len, &line, &n);
+    if (r < 0)
+        return stos_push (0) && stos_push (0) && stos_push (errno);
+    if (r == 0)
+        return stos_push (0) && stos_push (0) && stos_push (0);
+
+    stos_memcpy (stos_ptr (addr), line, n);
+    return stos_push (n) && stos_push (-1) && stos_push (0);
 }
 
+// ( fileid -- c-addr u flag ior ) the next line, where it sits in the read-ahead buffer. it stays there until
+// the next operation on the file. lines longer than FILE_BUFFER_SIZE come in pieces of that size
 bool
-prim_over (void)
+prim_next_line (void)
 {
-    stos_cell_t v = stos_dstack[stos_dsp - 2];
-    return stos_push (v);
+    stos_cell_t id;
+    if (!stos_pop (&id))
+        return false;
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
+        return false;
+
+    const uint8_t *line = NULL;
+    size_t n = 0;
+    int r = stos_file_line (f, FILE_BUFFER_SIZE, &line, &n);
+    return stos_push (stos_addr (line)) && stos_push (n) && stos_push (r > 0 ? -1 : 0)
+           && stos_push (r < 0 ? errno : 0);
 }
 
-bool
-prim_drop (void)
+static int
+stos_file_write (struct stos_file *f, const uint8_t *src, size_t len)
 {
-    stos_cell_t a;
-    return stos_pop (&a);
+    int err = stos_file_unread (f);
+    if (!err && f->wlen + len > FILE_BUFFER_SIZE)
+        err = stos_file_wflush (f);
+    if (err)
+        return err;
+
+    if (len >= FILE_BUFFER_SIZE) // straight through, the buffer is empty now
+        return stos_file_write_all (f->fd, src, len);
+
+    stos_memcpy (f->wbuf + f->wlen, src, len);
+    f->wlen += len;
+    return 0;
 }
 
+// ( c-addr u fileid -- ior )
 bool
-prim_dup (void)
+prim_write_file (void)
 {
-    stos_cell_t v = stos_dstack[stos_dsp - 1];
-    return stos_push (v);
+    stos_cell_t addr, len, id;
+    if (!stos_pop (&id) || !stos_pop (&len) || !stos_pop (&addr))
+        return false;
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
+        return false;
+    return stos_push (stos_file_write (f, stos_ptr (addr), stos_span (addr, len)));
 }
 
+// ( c-addr u fileid -- ior ) writes the characters and a newline
 bool
-prim_exit (void)
+prim_write_line (void)
 {
-    stos_bc_emit_op (OPCODE_RET);
-    return true;
+    stos_cell_t addr, len, id;
+    if (!stos_pop (&id) || !stos_pop (&len) || !stos_pop (&addr))
+        return false;
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
+        return false;
+
+    int err = stos_file_write (f, stos_ptr (addr), stos_span (addr, len));
+    if (!err)
+        err = stos_file_write (f, (const uint8_t *)"\n", 1);
+    return stos_push (err);
 }
 
+// ( fileid -- ior ) hands the write-behind buffer to the system
 bool
-prim_minus (void)
+prim_flush_file (void)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
+    stos_cell_t id;
+    if (!stos_pop (&id))
         return false;
-    if (!stos_pop (&b))
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
         return false;
-    return stos_push (b - a);
+    return stos_push (stos_file_wflush (f));
 }
 
+// ( fileid -- u ior ) a single cell, there are no double numbers
 bool
-prim_eq (void)
+prim_file_size (void)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
+    stos_cell_t id;
+    if (!stos_pop (&id))
         return false;
-    if (!stos_pop (&b))
+    struct stos_file *f = stos_file_of (id);
+    if (!f)
         return false;
-    return stos_push (a == b ? -1 : 0);
+
+    struct stat st;
+    int err = stos_file_wflush (f);
+    if (!err && fstat (f->fd, &st) != 0)
+        err = errno;
+    return stos_push (err ? 0 : (stos_cell_t)st.st_size) && stos_push (err);
 }
+#endif
 
-bool
-prim_if (void)
+#ifdef _STOS_BLOCKS
+// block storage. BLOCK_BUFFERS buffers cache the blocks of the host's device, `block` hands out the buffer
+// of a block (reading it in first if it isn't cached), `update` marks the last one handed out as changed.
+// changed buffers are written back when they're reused for another block, or by `save-buffers` / `flush`.
+// the buffer reused is always the least recently handed out one
+#ifdef _STOS_SANDBOX
+#define stos_block_data (stos_varspace + STOS_VARS_LIMIT + STRINGSPACE_SIZE) // above the string space
+#else
+STOS_TLS uint8_t stos_block_data[STOS_BLOCK_SPACE];
+#endif
+
+struct stos_block_buf
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
+    stos_cell_t blk;
+    stos_size_t used; // when it was last handed out, 0 while it holds no block
+    bool dirty;
+    uint8_t pins; // `load`s running from it, it can't be reused meanwhile
+};
+
+STOS_TLS struct stos_block_buf stos_blocks[BLOCK_BUFFERS];
+STOS_TLS stos_size_t stos_block_clock = 0;
+STOS_TLS stos_size_t stos_block_cur = 0; // the buffer `update` marks
+
+#define stos_block_buf_data(i) (stos_block_data + (size_t)(i) * BLOCK_SIZE)
+
+static bool
+stos_block_save (stos_size_t i)
+{
+    struct stos_block_buf *b = &stos_blocks[i];
+    if (b->used && b->dirty)
     {
-        stos_seterrstr ("`IF` OUTSIDE OF DEFINITION");
-        return false;
+        if (!stos_block_write (b->blk, stos_block_buf_data (i)))
+        {
+            stos_seterrstr ("CAN'T WRITE BLOCK");
+            return false;
+        }
+        b->dirty = false;
     }
-
-    stos_bc_emit_op (OPCODE_JZ);
-    stos_cpush (stos_pc);
-    stos_bc_emit_size (0); // placeholder
     return true;
 }
 
-bool
-prim_else (void)
+// the buffer of block n, read from the device if read is set. -1 on failure
+static stos_ssize_t
+stos_block_get (stos_cell_t n, bool read)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
+    stos_size_t i = stos_block_cur;
+    struct stos_block_buf *b = &stos_blocks[i];
+
+    // usually the same block again
+    if (!b->used || b->blk != n)
     {
-        stos_seterrstr ("`ELSE` OUTSIDE OF DEFINITION");
-        return false;
-    }
+        stos_size_t victim = BLOCK_BUFFERS;
+        for (i = 0; i < BLOCK_BUFFERS; i++)
+        {
+            b = &stos_blocks[i];
+            if (b->used && b->blk == n)
+                break;
+            if (!b->pins && (victim == BLOCK_BUFFERS || b->used < stos_blocks[victim].used))
+                victim = i;
+        }
 
-    stos_size_t if_addr;
-    if (!stos_cpop (&if_addr))
-        return false;
+        if (i == BLOCK_BUFFERS)
+        {
+            if (victim == BLOCK_BUFFERS)
+            {
+                stos_seterrstr ("NO FREE BLOCK BUFFER");
+                return -1;
+            }
+            if (!stos_block_save (victim))
+                return -1;
 
-    stos_bc_emit_op (OPCODE_JMP);
-    stos_cpush (stos_pc);
-    stos_bc_emit_size (0); // placeholder
+            i = victim;
+            b = &stos_blocks[i];
+            b->used = 0;
+            if (read && !stos_block_read (n, stos_block_buf_data (i)))
+            {
+                stos_seterrstr ("CAN'T READ BLOCK");
+                return -1;
+            }
+            b->blk = n;
+            b->dirty = false;
+        }
+        stos_block_cur = i;
+    }
 
-    for (size_t i = 0; i < sizeof (stos_size_t); i++)
-        stos_bytecode[if_addr + i] = (uint8_t)(stos_pc >> (i * 8));
-    return true;
+    b->used = ++stos_block_clock;
+    return i;
 }
 
+// ( u -- addr )
 bool
-prim_endif (void)
+prim_block (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`THEN` OUTSIDE OF DEFINITION");
-        return false;
-    }
-
-    stos_size_t addr;
-    if (!stos_cpop (&addr))
+    stos_cell_t n;
+    if (!stos_pop (&n))
         return false;
-
-    for (size_t i = 0; i < sizeof (stos_size_t); i++)
-        stos_bytecode[addr + i] = (uint8_t)(stos_pc >> (i * 8));
-    return true;
+    stos_ssize_t i = stos_block_get (n, true);
+    return i >= 0 && stos_push (stos_addr (stos_block_buf_data (i)));
 }
 
+// ( u -- addr ) like `block`, without reading what's on the device
 bool
-prim_do (void)
+prim_buffer (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`DO` OUTSIDE OF DEFINITION");
+    stos_cell_t n;
+    if (!stos_pop (&n))
         return false;
-    }
-    stos_bc_emit_op (OPCODE_DO);
-    return stos_cpush (stos_pc);
+    stos_ssize_t i = stos_block_get (n, false);
+    return i >= 0 && stos_push (stos_addr (stos_block_buf_data (i)));
 }
 
 bool
-prim_loop (void)
+prim_update (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
+    if (!stos_blocks[stos_block_cur].used)
     {
-        stos_seterrstr ("`LOOP` OUTSIDE OF DEFINITION");
+        stos_seterrstr ("NO CURRENT BLOCK");
         return false;
     }
-    stos_bc_emit_op (OPCODE_PUSH_CELL);
-    stos_bc_emit_addr (1);
-    stos_bc_emit_op (OPCODE_LOOP);
-    stos_size_t addr;
-    if (!stos_cpop (&addr))
-        return false;
-    stos_bc_emit_size (addr);
+    stos_blocks[stos_block_cur].dirty = true;
     return true;
 }
 
 bool
-prim_ploop (void)
+prim_save_buffers (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`+LOOP` OUTSIDE OF DEFINITION");
-        return false;
-    }
-    stos_bc_emit_op (OPCODE_LOOP);
-    stos_size_t addr;
-    if (!stos_cpop (&addr))
-        return false;
-    stos_bc_emit_size (addr);
+    for (stos_size_t i = 0; i < BLOCK_BUFFERS; i++)
+        if (!stos_block_save (i))
+            return false;
     return true;
 }
 
-bool
-prim_tor (void)
+// forgets the cached blocks, and whatever changes weren't saved. flushing first saves them
+static bool
+stos_block_empty (bool flush)
 {
-    stos_cell_t v;
-    if (!stos_pop (&v))
+    if (flush && !prim_save_buffers ())
         return false;
-
-    return stos_rpush (v);
+    for (stos_size_t i = 0; i < BLOCK_BUFFERS; i++)
+        if (!stos_blocks[i].pins)
+            stos_blocks[i].used = 0;
+    return true;
 }
 
 bool
-prim_fromr (void)
+prim_flush (void)
 {
-    stos_size_t v;
-    if (!stos_rpop (&v))
-        return false;
-    return stos_push ((stos_number_t)v);
+    return stos_block_empty (true);
 }
 
 bool
-prim_rfetch (void)
+prim_empty_buffers (void)
 {
-    stos_size_t v = stos_rstack[stos_rsp - 1];
-    stos_push ((stos_number_t)v);
-    return true;
+    return stos_block_empty (false);
 }
 
+// ( u -- ) interprets the block, as if its BLOCK_SIZE characters were typed at the REPL
 bool
-prim_rot (void)
+prim_load (void)
 {
-    stos_cell_t a, b, c;
-    if (!stos_pop (&c))
+    stos_cell_t n;
+    if (!stos_pop (&n))
         return false;
-    if (!stos_pop (&b))
+    if (n == 0)
+    {
+        stos_seterrstr ("CAN'T LOAD BLOCK 0");
         return false;
-    if (!stos_pop (&a))
+    }
+    stos_ssize_t i = stos_block_get (n, true);
+    if (i < 0)
         return false;
 
-    if (!stos_push (b))
-        return false;
-    if (!stos_push (c))
-        return false;
-    return stos_push (a);
+    const char *cursor = stos_input_cursor, *end = stos_input_end;
+    struct token token = current_token;
+    stos_blocks[i].pins++;
+
+    // whatever the block throws, the buffer gets unpinned and the input comes back on the way out
+    struct stos_frame frame;
+    stos_frame_enter (&frame, false);
+    bool thrown = stos_setjmp (frame.env) != 0;
+    bool ok = false;
+    if (!thrown)
+    {
+        stos_input_set ((const char *)stos_block_buf_data (i), BLOCK_SIZE);
+        ok = stos_interpret ();
+        stos_frame_leave (&frame);
+    }
+
+    stos_blocks[i].pins--;
+    stos_input_cursor = cursor;
+    stos_input_end = end;
+    current_token = token;
+    if (stos_scratch) // structures end with the block
+    {
+        stos_scratch_drop ();
+        if (ok)
+        {
+            stos_seterrstr ("UNFINISHED STRUCTURE IN BLOCK");
+            ok = false;
+        }
+    }
+    if (thrown)
+        stos_rethrow ();
+    return ok;
 }
 
+// ( u -- ) prints the block as 16 numbered lines
 bool
-prim_putstack (void)
+prim_list (void)
 {
-    stos_putc ('<');
-    stos_putn (stos_dsp);
-    stos_putc ('>');
-    stos_putc (' ');
-    for (stos_size_t i = 0; i < stos_dsp; ++i)
+    stos_cell_t n;
+    if (!stos_pop (&n))
+        return false;
+    stos_ssize_t i = stos_block_get (n, true);
+    if (i < 0)
+        return false;
+
+    const uint8_t *text = stos_block_buf_data (i);
+    for (stos_size_t line = 0; line < BLOCK_SIZE / 64; line++)
     {
-        stos_putn (stos_dstack[i]);
+        if (line < 10)
+            stos_putc (' ');
+        stos_putn (line);
         stos_putc (' ');
+        for (stos_size_t c = 0; c < 64; c++)
+        {
+            uint8_t ch = text[line * 64 + c];
+            stos_putc (ch >= ' ' && ch < 127 ? ch : ' ');
+        }
+        stos_write ("\r\n");
     }
-    stos_putc ('\r');
-    stos_putc ('\n');
     return true;
 }
+#endif
 
-bool
-prim_emit (void)
+// relocatable modules. `module` marks the start of a library, `end-module` serializes every word defined
+// since then (code, varspace and relocations) into a buffer, and `require-module` links such an image
+// into the running dictionary, resolving the words it calls by name.
+//
+// image layout, multi-byte fields little-endian like the bytecode itself:
+//   "STM1", sizeof cell, sizeof size, MAX_STRING_SIZE, bytecode encoding
+//   nwords, nimports, code_len, var_len, nrelocs
+//   nwords * { name[MAX_STRING_SIZE], code_off, code_len, flags }
+//   code_len bytes of code, var_len bytes of varspace
+//   nimports * name[MAX_STRING_SIZE]
+//   nrelocs * { type, offset into code }
+// in the image's code, jump targets and variable offsets are relative to the module, and word ids
+// index its words (< nwords) or its imports (>= nwords)
+
+enum stos_reloc_type
 {
-    stos_cell_t c;
-    if (!stos_pop (&c))
-        return false;
-    stos_putc (c);
-    return true;
+    RELOC_NONE,
+    RELOC_WORD,
+    RELOC_JUMP,
+    RELOC_VAR,
+};
+
+#define STOS_MODULE_HEADER_SIZE (8 + 5 * sizeof (stos_size_t))
+#define STOS_MODULE_WORD_SIZE (MAX_STRING_SIZE + 2 * sizeof (stos_size_t) + 1)
+#define STOS_MODULE_RELOC_SIZE (1 + sizeof (stos_size_t))
+
+#ifdef _STOS_COMPACT_BC
+#define STOS_MODULE_ENCODING 1
+#else
+#define STOS_MODULE_ENCODING 0
+#endif
+
+STOS_TLS stos_size_t stos_module_word = 0, stos_module_pc = 0, stos_module_vsp = 0;
+
+static void
+stos_put_uint (uint8_t *p, stos_size_t v, uint8_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        p[i] = (uint8_t)(v >> (i * 8));
 }
 
-bool
-prim_mult (void)
+static stos_size_t
+stos_get_uint (const uint8_t *p, uint8_t size)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (a * b);
+    stos_size_t result = 0;
+    for (size_t i = 0; i < size; i++)
+        result |= ((stos_size_t)p[i]) << (i * 8);
+    return result;
 }
 
-bool
-prim_div (void)
+#define stos_put_size(p, v) stos_put_uint ((p), (v), sizeof (stos_size_t))
+#define stos_get_size(p) stos_get_uint ((p), sizeof (stos_size_t))
+
+// width of the operand a relocation patches
+static uint8_t
+stos_reloc_size (uint8_t type)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (b / a);
+    switch (type)
+    {
+    case RELOC_WORD:
+        return SIZEOF_WORD_ID;
+    case RELOC_VAR:
+        return SIZEOF_VAR_OFF;
+    default:
+        return SIZEOF_BC_ADDR;
+    }
 }
 
-bool
-prim_mod (void)
+// copies a name into a zero-padded MAX_STRING_SIZE field
+static void
+stos_put_name (uint8_t *p, const char *name)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (b % a);
+    stos_size_t len = stos_strlen (name);
+    stos_memcpy (p, name, len);
+    stos_memset (p + len, 0, MAX_STRING_SIZE - len);
 }
 
-bool
-prim_lt (void)
+// decodes the instruction at *pc and steps over it. returns what its operand refers to,
+// and where the operand is stored through operand
+static uint8_t
+stos_bc_decode (stos_size_t *pc, stos_size_t *operand)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (b < a);
+    uint8_t op = stos_bytecode[(*pc)++];
+    *operand = *pc;
+    switch (op)
+    {
+    case OPCODE_PUSH_CELL:
+        *pc += sizeof (stos_cell_t);
+        return RELOC_NONE;
+#ifdef _STOS_COMPACT_BC
+    case OPCODE_PUSH_BYTE:
+        *pc += 1;
+        return RELOC_NONE;
+    case OPCODE_PUSH_SHORT:
+        *pc += 2;
+        return RELOC_NONE;
+#endif
+    case OPCODE_PUSH_VAR:
+        *pc += SIZEOF_VAR_OFF;
+        return RELOC_VAR;
+    case OPCODE_CALL_ID:
+    case OPCODE_PUSH_XT:
+        *pc += SIZEOF_WORD_ID;
+        return RELOC_WORD;
+    case OPCODE_JMP:
+    case OPCODE_JZ:
+    case OPCODE_JNZ:
+    case OPCODE_LOOP:
+    case OPCODE_PDO:
+    case OPCODE_PDO_REDUCE:
+        *pc += SIZEOF_BC_ADDR;
+        return RELOC_JUMP;
+    case OPCODE_PRINT_STR:
+    case OPCODE_PUSH_STRING: {
+        stos_size_t len = stos_bc_read_uint (pc, SIZEOF_STR_LEN);
+        *pc += len;
+        return RELOC_NONE;
+    }
+    default:
+        return RELOC_NONE;
+    }
 }
 
-bool
-prim_lte (void)
+// index of name in the image's import table, appending it if it's not there yet. -1 when out of space
+static stos_ssize_t
+stos_module_import (uint8_t *imports, stos_size_t *nimports, const char *name, const uint8_t *end)
 {
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (b <= a);
+    for (stos_size_t i = 0; i < *nimports; i++)
+        if (stos_strcasesame (name, stos_strlen (name), (const char *)imports + i * MAX_STRING_SIZE))
+            return i;
+
+    uint8_t *slot = imports + *nimports * MAX_STRING_SIZE;
+    if (slot + MAX_STRING_SIZE > end)
+        return -1;
+    stos_put_name (slot, name);
+    return (*nimports)++;
 }
 
-bool
-prim_gt (void)
-{
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (b > a);
-}
+bool
+stos_module_build (uint8_t *buf, stos_size_t cap, stos_size_t *out_len)
+{
+    stos_size_t first = stos_module_word;
+    stos_size_t nwords = stos_word_count - first;
+    stos_size_t code_lo = stos_module_pc, code_len = stos_pc - code_lo;
+    stos_size_t var_lo = stos_module_vsp, var_len = stos_vsp - var_lo;
+    const uint8_t *end = buf + cap;
+
+    if (cap < STOS_MODULE_HEADER_SIZE + nwords * STOS_MODULE_WORD_SIZE + code_len + var_len)
+        goto too_small;
+
+    uint8_t *p = buf + STOS_MODULE_HEADER_SIZE;
+    for (stos_size_t i = first; i < stos_word_count; i++, p += STOS_MODULE_WORD_SIZE)
+    {
+        if (stos_words[i].flags & STOS_PRIMITIVE)
+        {
+            stos_seterrstr ("MODULE CAN'T CONTAIN PRIMITIVES");
+            return false;
+        }
+        stos_put_name (p, stos_words[i].name);
+        stos_put_size (p + MAX_STRING_SIZE, stos_words[i].code_off - code_lo);
+        stos_put_size (p + MAX_STRING_SIZE + sizeof (stos_size_t), stos_words[i].code_len);
+        p[MAX_STRING_SIZE + 2 * sizeof (stos_size_t)] = stos_words[i].flags;
+    }
+
+    uint8_t *code = p;
+    stos_memcpy (code, &stos_bytecode[code_lo], code_len);
+    p += code_len;
+    stos_memcpy (p, &stos_varspace[var_lo], var_len);
+    p += var_len;
+
+    // first pass collects the imports, so the relocations can follow them
+    uint8_t *imports = p;
+    stos_size_t nimports = 0;
+    for (stos_size_t pc = code_lo, at; pc < stos_pc;)
+    {
+        if (stos_bc_decode (&pc, &at) != RELOC_WORD)
+            continue;
+        stos_size_t tid = stos_bc_read_uint (&at, SIZEOF_WORD_ID);
+        if (tid < first && stos_module_import (imports, &nimports, stos_words[tid].name, end) < 0)
+            goto too_small;
+    }
+    p += nimports * MAX_STRING_SIZE;
+
+    stos_size_t nrelocs = 0;
+    for (stos_size_t pc = code_lo, at; pc < stos_pc;)
+    {
+        uint8_t type = stos_bc_decode (&pc, &at);
+        if (type == RELOC_NONE)
+            continue;
+
+        stos_size_t off = at - code_lo;
+        stos_size_t value = stos_bc_read_uint (&at, stos_reloc_size (type));
+        switch (type)
+        {
+        case RELOC_WORD:
+            value = (value < first) ? nwords + stos_module_import (imports, &nimports, stos_words[value].name, end)
+                                    : value - first;
+            break;
+        case RELOC_JUMP:
+            value -= code_lo;
+            break;
+        case RELOC_VAR:
+            if (value < var_lo)
+            {
+                stos_seterrstr ("MODULE USES VARIABLE DEFINED OUTSIDE OF IT");
+                return false;
+            }
+            value -= var_lo;
+            break;
+        }
+
+        if (p + STOS_MODULE_RELOC_SIZE > end)
+            goto too_small;
+        p[0] = type;
+        stos_put_size (p + 1, off);
+        stos_put_uint (code + off, value, stos_reloc_size (type));
+        p += STOS_MODULE_RELOC_SIZE;
+        nrelocs++;
+    }
 
-bool
-prim_gte (void)
-{
-    stos_cell_t a, b;
-    if (!stos_pop (&a))
-        return false;
-    if (!stos_pop (&b))
-        return false;
-    return stos_push (b >= a);
+    stos_memcpy (buf, "STM1", 4);
+    buf[4] = sizeof (stos_cell_t);
+    buf[5] = sizeof (stos_size_t);
+    buf[6] = MAX_STRING_SIZE;
+    buf[7] = STOS_MODULE_ENCODING;
+    stos_put_size (buf + 8, nwords);
+    stos_put_size (buf + 8 + sizeof (stos_size_t), nimports);
+    stos_put_size (buf + 8 + 2 * sizeof (stos_size_t), code_len);
+    stos_put_size (buf + 8 + 3 * sizeof (stos_size_t), var_len);
+    stos_put_size (buf + 8 + 4 * sizeof (stos_size_t), nrelocs);
+
+    *out_len = p - buf;
+    return true;
+
+too_small:
+    stos_seterrstr ("MODULE BUFFER TOO SMALL");
+    return false;
 }
 
-bool
-prim_fetch (void)
+// checks every index and offset in the image against its header, before anything is copied
+static bool
+stos_module_valid (const uint8_t *words, stos_size_t nwords, const uint8_t *code, stos_size_t code_len,
+                   const uint8_t *imports, stos_size_t nimports, const uint8_t *relocs, stos_size_t nrelocs)
 {
-    stos_cell_t addr;
-    if (!stos_pop (&addr))
-        return false;
+    for (stos_size_t i = 0; i < nwords; i++, words += STOS_MODULE_WORD_SIZE)
+    {
+        uint64_t off = stos_get_size (words + MAX_STRING_SIZE);
+        uint64_t wlen = stos_get_size (words + MAX_STRING_SIZE + sizeof (stos_size_t));
+        uint8_t flags = words[MAX_STRING_SIZE + 2 * sizeof (stos_size_t)];
+        if (off >= code_len || off + wlen > code_len || (flags & STOS_PRIMITIVE))
+            return false;
+    }
 
-    stos_cell_t value = *(stos_cell_t *)addr;
-    return stos_push (value);
+    for (stos_size_t i = 0; i < nimports; i++)
+        if (!stos_memchr (imports + i * MAX_STRING_SIZE, 0, MAX_STRING_SIZE))
+            return false;
+
+    for (stos_size_t i = 0; i < nrelocs; i++, relocs += STOS_MODULE_RELOC_SIZE)
+    {
+        uint8_t type = relocs[0];
+        if (type != RELOC_WORD && type != RELOC_JUMP && type != RELOC_VAR)
+            return false;
+        uint64_t at = stos_get_size (relocs + 1);
+        if (at + stos_reloc_size (type) > code_len)
+            return false;
+        if (type != RELOC_WORD)
+            continue;
+        stos_size_t id = stos_get_uint (code + at, SIZEOF_WORD_ID); // one of the module's words, or an import
+        if (id >= nwords && id - nwords >= nimports)
+            return false;
+    }
+    return true;
 }
 
-bool
-prim_store (void)
+// walks the linked code at pc: every instruction has to end inside it, and every operand has to point
+// at a word, into the code or into the variables the module has
+static bool
+stos_module_code_valid (stos_size_t pc, stos_size_t code_len, stos_size_t words, stos_size_t vsp)
 {
-    stos_cell_t addr, value;
-    if (!stos_pop (&addr))
-        return false;
-    if (!stos_pop (&value))
-        return false;
+    stos_size_t lo = pc, end = pc + code_len;
+    while (pc < end)
+    {
+        uint8_t op = stos_bytecode[pc];
+        if ((op == OPCODE_PRINT_STR || op == OPCODE_PUSH_STRING) && end - pc < SIZEOF_OPCODE + SIZEOF_STR_LEN)
+            return false;
+
+        stos_size_t at;
+        uint8_t type = stos_bc_decode (&pc, &at);
+        if (pc > end)
+            return false;
+        if (type == RELOC_NONE)
+            continue;
 
-    *(stos_cell_t *)addr = value;
+        stos_size_t value = stos_bc_read_uint (&at, stos_reloc_size (type));
+        if ((type == RELOC_WORD && value >= words) || (type == RELOC_JUMP && (value < lo || value >= end))
+            || (type == RELOC_VAR && value > vsp))
+            return false;
+    }
     return true;
 }
 
 bool
-prim_move (void)
+stos_module_link (const uint8_t *img, stos_size_t len)
 {
-    stos_cell_t dest, src, u;
-    if (!stos_pop (&u))
-        return false;
-    if (!stos_pop (&dest))
+    if (len < STOS_MODULE_HEADER_SIZE || stos_memcmp (img, "STM1", 4) != 0 || img[4] != sizeof (stos_cell_t)
+        || img[5] != sizeof (stos_size_t) || img[6] != MAX_STRING_SIZE || img[7] != STOS_MODULE_ENCODING)
+    {
+        stos_seterrstr ("INVALID MODULE");
         return false;
-    if (!stos_pop (&src))
+    }
+
+    stos_size_t nwords = stos_get_size (img + 8);
+    stos_size_t nimports = stos_get_size (img + 8 + sizeof (stos_size_t));
+    stos_size_t code_len = stos_get_size (img + 8 + 2 * sizeof (stos_size_t));
+    stos_size_t var_len = stos_get_size (img + 8 + 3 * sizeof (stos_size_t));
+    stos_size_t nrelocs = stos_get_size (img + 8 + 4 * sizeof (stos_size_t));
+
+    // 64 bit, the counts come from the image and are up to 2^32 each
+    uint64_t need = (uint64_t)STOS_MODULE_HEADER_SIZE + (uint64_t)nwords * STOS_MODULE_WORD_SIZE + code_len + var_len
+                    + (uint64_t)nimports * MAX_STRING_SIZE + (uint64_t)nrelocs * STOS_MODULE_RELOC_SIZE;
+    if (need > len)
+    {
+        stos_seterrstr ("INVALID MODULE");
         return false;
+    }
 
-    stos_memmove ((void *)dest, (void *)src, u);
-    return true;
-}
+    const uint8_t *words = img + STOS_MODULE_HEADER_SIZE;
+    const uint8_t *code = words + nwords * STOS_MODULE_WORD_SIZE;
+    const uint8_t *vars = code + code_len;
+    const uint8_t *imports = vars + var_len;
+    const uint8_t *relocs = imports + nimports * MAX_STRING_SIZE;
 
-bool
-prim_fill (void)
-{
-    stos_cell_t addr, u, byte;
-    if (!stos_pop (&byte))
+    if (!stos_module_valid (words, nwords, code, code_len, imports, nimports, relocs, nrelocs))
+    {
+        stos_seterrstr ("INVALID MODULE");
         return false;
-    if (!stos_pop (&u))
+    }
+
+    if (nwords > stos_word_hi - stos_word_count || code_len > stos_pc_hi - stos_pc || var_len > stos_vsp_hi - stos_vsp)
+    {
+        stos_seterrstr ("MODULE DOESN'T FIT");
         return false;
-    if (!stos_pop (&addr))
+    }
+
+    // resolve everything up front, so a failed link leaves the dictionary untouched
+    uint16_t wid = 0;
+    for (stos_size_t i = 0; i < nimports; i++)
+    {
+        const char *name = (const char *)imports + i * MAX_STRING_SIZE;
+        if (!stos_strto_wrdid (name, stos_strlen (name), &wid))
+        {
+            stos_seterrstr ("UNRESOLVED MODULE IMPORT");
+            return false;
+        }
+    }
+
+    stos_size_t word_base = stos_word_count, pc_base = stos_pc, var_base = stos_vsp;
+
+    // the code goes into the free bytecode first, the dictionary only takes it once it checks out
+    stos_memcpy (&stos_bytecode[pc_base], code, code_len);
+    stos_memcpy (&stos_varspace[var_base], vars, var_len);
+
+    for (stos_size_t i = 0; i < nrelocs; i++, relocs += STOS_MODULE_RELOC_SIZE)
+    {
+        stos_size_t at = pc_base + stos_get_size (relocs + 1);
+        stos_size_t value = stos_get_uint (code + (at - pc_base), stos_reloc_size (relocs[0]));
+        switch (relocs[0])
+        {
+        case RELOC_WORD:
+            if (value < nwords)
+                value += word_base;
+            else
+            {
+                const char *name = (const char *)imports + (value - nwords) * MAX_STRING_SIZE;
+                stos_strto_wrdid (name, stos_strlen (name), &wid);
+                value = wid;
+            }
+            break;
+        case RELOC_JUMP:
+            value += pc_base;
+            break;
+        case RELOC_VAR:
+            value += var_base;
+            break;
+        }
+        stos_bc_patch_uint (at, value, stos_reloc_size (relocs[0]));
+    }
+
+    if (!stos_module_code_valid (pc_base, code_len, word_base + nwords, var_base + var_len))
+    {
+        stos_seterrstr ("INVALID MODULE");
         return false;
+    }
+
+    for (stos_size_t i = 0; i < nwords; i++, words += STOS_MODULE_WORD_SIZE)
+    {
+        struct stos_word *w = &stos_words[word_base + i];
+        stos_memcpy (w->name, words, MAX_STRING_SIZE);
+        w->name[MAX_STRING_SIZE - 1] = '\0';
+        w->code_off = pc_base + stos_get_size (words + MAX_STRING_SIZE);
+        w->code_len = stos_get_size (words + MAX_STRING_SIZE + sizeof (stos_size_t));
+        w->flags = words[MAX_STRING_SIZE + 2 * sizeof (stos_size_t)];
+    }
 
-    stos_memset ((void *)addr, (uint8_t)byte, u);
+    stos_word_count += nwords;
+    stos_pc += code_len;
+    stos_vsp += var_len;
     return true;
 }
 
 bool
-prim_cells (void)
+prim_module (void)
 {
-    stos_cell_t n;
-    if (!stos_pop (&n))
+    if (stos_mode != MODE_INTERPRET)
+    {
+        stos_seterrstr ("`MODULE` IN DEFINITION");
         return false;
+    }
 
-    return stos_push (n * sizeof (stos_cell_t));
+    stos_module_word = stos_word_count;
+    stos_module_pc = stos_pc;
+    stos_module_vsp = stos_vsp;
+    return true;
 }
 
 bool
-prim_cfetch (void)
+prim_end_module (void)
 {
-    stos_cell_t addr;
-    if (!stos_pop (&addr))
+    stos_cell_t addr, cap;
+    if (!stos_pop (&cap) || !stos_pop (&addr))
         return false;
 
-    uint8_t value = *(uint8_t *)addr;
-    return stos_push (value);
+    stos_size_t len;
+    if (!stos_module_build (stos_ptr (addr), stos_span (addr, cap), &len))
+        return false;
+    return stos_push (len);
 }
 
 bool
-prim_cstore (void)
+prim_require_module (void)
 {
-    stos_cell_t addr, value;
-    if (!stos_pop (&addr))
-        return false;
-    if (!stos_pop (&value))
+    stos_cell_t addr, len;
+    if (!stos_pop (&len) || !stos_pop (&addr))
         return false;
 
-    *(uint8_t *)addr = (uint8_t)value;
-    return true;
+    return stos_module_link (stos_ptr (addr), stos_span (addr, len));
 }
 
-bool
-prim_key (void)
+// dictionary rollback. words, bytecode and varspace are all allocated in order,
+// so a checkpoint is just the word id to cut at (its code_off is the bytecode mark) and the varspace mark.
+// the transient string space needs no checkpoint, it's reclaimed after every line anyway
+
+#ifdef _STOS_MEMSTATS
+// the dictionary, bytecode and varspace only shrink here, so looking at them before is enough
+static void
+stos_mem_sample (void)
 {
-    stos_cell_t c = stos_getc ();
-    // fprintf (stderr, "[c = 2x%02X; %c]\n", (char)c, (char)c);
-    return stos_push (c);
+    stos_mem_mark (stos_mem_hw.words, stos_word_count - stos_word_lo);
+    stos_mem_mark (stos_mem_hw.pc, stos_pc - stos_pc_lo);
+    stos_mem_mark (stos_mem_hw.vsp, stos_vsp - stos_vsp_lo);
 }
 
-bool
-prim_begin (void)
+void
+stos_mem_high (struct stos_mem *m)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`BEGIN` OUTSIDE OF DEFINITION");
-        return false;
-    }
-    return stos_cpush (stos_pc);
+    stos_mem_sample ();
+    *m = stos_mem_hw;
+    m->dsp = stos_mem_stacks[0].dsp;
+    m->rsp = stos_mem_stacks[0].rsp;
+    m->task_dsp = stos_mem_stacks[1].dsp;
+    m->task_rsp = stos_mem_stacks[1].rsp;
+    m->prims = stos_prim_count;
 }
 
-bool
-prim_until (void)
+static void
+stos_mem_put (const char *name, stos_size_t high, stos_size_t size)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`UNTIL` OUTSIDE OF DEFINITION");
-        return false;
-    }
-
-    stos_size_t begin;
-    if (!stos_cpop (&begin))
-        return false;
-
-    stos_bc_emit_op (OPCODE_JZ);
-    stos_bc_emit_size (begin);
-    return true;
+    stos_write (name);
+    stos_putc (' ');
+    stos_putn (high);
+    stos_putc ('/');
+    stos_putn (size);
+    stos_putc ('\r');
+    stos_putc ('\n');
 }
 
+// high-water mark and size of every region
 bool
-prim_while (void)
+prim_mem (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`WHILE` OUTSIDE OF DEFINITION");
-        return false;
-    }
+    struct stos_mem m;
+    stos_mem_high (&m);
+    stos_mem_put ("data stack", m.dsp, DATA_STACK_SIZE);
+    stos_mem_put ("return stack", m.rsp, RETURN_STACK_SIZE);
+    stos_mem_put ("compile stack", m.csp, COMPILE_STACK_SIZE);
+    stos_mem_put ("task data stack", m.task_dsp, TASK_DATA_STACK_SIZE);
+    stos_mem_put ("task return stack", m.task_rsp, TASK_RETURN_STACK_SIZE);
+    stos_mem_put ("bytecode", m.pc, stos_pc_hi - stos_pc_lo);
+    stos_mem_put ("varspace", m.vsp, stos_vsp_hi - stos_vsp_lo);
+    stos_mem_put ("strings", m.strp, STRINGSPACE_SIZE);
+    stos_mem_put ("words", m.words, stos_word_hi - stos_word_lo);
+    return true;
+}
+#endif
 
-    if (!stos_cpush (stos_pc))
-        return false;
+#ifdef _STOS_MMAP
+// a rollback leaves the trim for later: the marker that ran it (and whatever called the marker) is still
+// executing from the code it forgot. stos_dict_trim gives the pages back once that has returned
+STOS_TLS bool stos_dict_trim_pending = false;
 
-    stos_bc_emit_op (OPCODE_JZ);
-    stos_bc_emit_size (0); // placeholder
-    return true;
+void
+stos_dict_trim (void)
+{
+    if (!stos_dict_trim_pending || stos_run_pending) // a suspended run may be stopped in there
+        return;
+    stos_dict_trim_pending = false;
+#ifndef _STOS_THREADS // other VMs' slices lie above this one's
+    stos_arena_trim (&stos_arenas[ARENA_BYTECODE], stos_pc);
+    stos_arena_trim (&stos_arenas[ARENA_WORDS], stos_word_count * sizeof (struct stos_word));
+#endif
+    stos_arena_trim (&stos_arenas[ARENA_VARSPACE], stos_vsp);
 }
+#else
+#define stos_dict_trim()
+#endif
 
-bool
-prim_repeat (void)
+void
+stos_dict_rollback (stos_size_t id, stos_size_t vsp)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
-    {
-        stos_seterrstr ("`REPEAT` OUTSIDE OF DEFINITION");
-        return false;
-    }
+#ifdef _STOS_MEMSTATS
+    stos_mem_sample ();
+#endif
+    if (id < stos_word_count) // at the end of the dictionary there's no code to cut, see stos_mark_reset
+        stos_pc = stos_words[id].code_off;
+    stos_word_count = id;
+    stos_vsp = vsp;
 
-    stos_size_t while_addr, begin_addr;
-    if (!stos_cpop (&while_addr))
-        return false;
-    if (!stos_cpop (&begin_addr))
-        return false;
+#ifdef _STOS_MMAP
+    stos_dict_trim_pending = true;
+#endif
 
-    stos_bc_emit_op (OPCODE_JMP);
-    stos_bc_emit_size (begin_addr);
+    if (stos_module_word > id && stos_module_word < stos_word_hi)
+    {
+        stos_module_word = id;
+        stos_module_pc = stos_pc;
+        stos_module_vsp = stos_vsp;
+    }
 
-    for (size_t i = 0; i < sizeof (stos_size_t); i++)
-        stos_bytecode[while_addr + i] = (uint8_t)(stos_pc >> (i * 8));
-    return true;
+    // tasks running forgotten code can't go on
+    for (stos_size_t i = 1; i < stos_task_count; i++)
+        if (stos_tasks[i].pc >= stos_pc && stos_tasks[i].pc < stos_pc_hi)
+            stos_tasks[i].state = TASK_STOPPED;
 }
 
+#ifndef _STOS_NO_TOOLS
+// primitives (the host can register them at any time) are never forgotten
 bool
-prim_again (void)
+stos_dict_forgettable (stos_size_t id)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
+    if (id < stos_word_lo)
     {
-        stos_seterrstr ("`AGAIN` OUTSIDE OF DEFINITION");
+        stos_seterrstr ("CAN'T FORGET SHARED WORDS");
         return false;
     }
-
-    stos_size_t loop_start;
-    if (!stos_cpop (&loop_start))
-        return false;
-
-    stos_bc_emit_op (OPCODE_JMP);
-    stos_bc_emit_size (loop_start);
-
+    for (stos_size_t i = id; i < stos_word_count; i++)
+    {
+        if (stos_words[i].flags & STOS_PRIMITIVE)
+        {
+            stos_seterrstr ("CAN'T FORGET PRIMITIVES");
+            return false;
+        }
+    }
     return true;
 }
 
+// runtime of a marker word ( vsp id -- )
 bool
-prim_recurse (void)
+prim_do_marker (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
+    stos_cell_t id, vsp;
+    if (!stos_pop (&id) || !stos_pop (&vsp))
+        return false;
+
+    if (id >= stos_word_count)
     {
-        stos_seterrstr ("`RECURSE` OUTSIDE OF DEFINITION");
+        stos_seterrstr ("MARKER ALREADY FORGOTTEN");
         return false;
     }
+    if (!stos_dict_forgettable (id))
+        return false;
 
-    stos_size_t current_word_id = stos_word_count - 1;
-    stos_bc_emit_op (OPCODE_CALL_ID);
-    stos_bc_emit_size (current_word_id);
+    stos_dict_rollback (id, vsp);
     return true;
 }
 
 bool
-prim_putstr (void)
+prim_marker (void)
 {
-    if (stos_mode != MODE_COMPILE_TOKS)
+    if (stos_mode != MODE_INTERPRET)
     {
-        stos_seterrstr ("`.\"` OUTSIDE OF DEFINITION");
+        stos_seterrstr ("`MARKER` IN DEFINITION");
         return false;
     }
 
-    char *p = stos_input_cursor;
-    while (*stos_input_cursor != '"' && *stos_input_cursor != '\0')
-        stos_input_cursor++;
-
-    if (*stos_input_cursor != '"')
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
     {
-        stos_seterrstr ("UNTERMINATED STRING");
+        stos_seterrstr ("EXPECTED WORD AFTER `MARKER`");
         return false;
     }
 
-    stos_size_t len = stos_input_cursor - p;
-    stos_input_cursor++;
-
-    stos_bc_emit_op (OPCODE_PRINT_STR);
-    stos_bc_emit_size (len);
-    for (stos_size_t i = 0; i < len; i++)
-        stos_bytecode[stos_pc++] = p[i];
+    uint16_t runtime;
+    if (!stos_strto_wrdid ("(marker)", 8, &runtime))
+        return false;
 
-    return true;
-}
+    stos_size_t vsp = stos_vsp;
+    stos_ssize_t id = stos_word_create (current_token.str, current_token.len, 0);
+    if (id < 0)
+        return false;
 
-bool
-prim_cr (void)
-{
-    stos_write ("\r\n");
+    stos_bc_emit_literal (vsp);
+    stos_bc_emit_literal (id);
+    stos_bc_emit_op (OPCODE_CALL_ID);
+    stos_bc_emit_uint (runtime, SIZEOF_WORD_ID);
+    stos_bc_emit_op (OPCODE_RET);
+    stos_word_finish (id);
     return true;
 }
 
 bool
-prim_var (void)
+prim_forget (void)
 {
     if (stos_mode != MODE_INTERPRET)
     {
-        stos_seterrstr ("`VARIABLE` IN DEFINITION");
+        stos_seterrstr ("`FORGET` IN DEFINITION");
         return false;
     }
 
+    uint16_t id;
     if (!stos_token_next () || current_token.type != TOKEN_WORD)
     {
-        stos_seterrstr ("EXPECTED WORD AFTER `VARIABLE`");
+        stos_seterrstr ("EXPECTED WORD AFTER `FORGET`");
         return false;
     }
-
-    if (stos_vsp >= VARSPACE_SIZE)
+    if (!stos_strto_wrdid (current_token.str, current_token.len, &id))
     {
-        stos_seterrstr ("VARIABLE SPACE AT CAPACITY");
+        stos_seterrstr ("INVALID WORD");
         return false;
     }
 
-    stos_cell_t var_addr = (stos_cell_t)&stos_varspace[stos_vsp];
-    stos_vsp++;
-
-    stos_varspace[stos_vsp - 1] = 0;
-
-    stos_ssize_t id = stos_word_create (current_token.str, 0);
-    if (id < 0)
+    if (!stos_dict_forgettable (id))
         return false;
 
-    stos_bc_emit_op (OPCODE_PUSH_CELL);
-    stos_bc_emit_addr (var_addr);
-    stos_bc_emit_op (OPCODE_RET);
-    stos_word_finish (id);
+    // varspace goes back to the lowest variable the forgotten words refer to
+    stos_size_t vsp = stos_vsp;
+    for (stos_size_t pc = stos_words[id].code_off, at; pc < stos_pc;)
+    {
+        if (stos_bc_decode (&pc, &at) != RELOC_VAR)
+            continue;
+        stos_size_t off = stos_bc_read_uint (&at, SIZEOF_VAR_OFF);
+        if (off < vsp)
+            vsp = off;
+    }
 
+    stos_dict_rollback (id, vsp);
     return true;
 }
+#endif
 
 bool
-prim_constant (void)
+prim_task (void)
 {
     if (stos_mode != MODE_INTERPRET)
     {
-        stos_seterrstr ("`CONSTANT` IN DEFINITION");
+        stos_seterrstr ("`TASK:` IN DEFINITION");
         return false;
     }
 
-    stos_cell_t value;
-    if (!stos_pop (&value))
+    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+    {
+        stos_seterrstr ("EXPECTED WORD AFTER `TASK:`");
+        return false;
+    }
+
+    if (stos_task_count >= MAX_TASKS)
+    {
+        stos_seterrstr ("TOO MANY TASKS");
         return false;
+    }
 
-    if (!stos_token_next () || current_token.type != TOKEN_WORD)
+#ifdef _STOS_THREADS
+    if (stos_sharing) // the tasks are the VM's own
     {
-        stos_seterrstr ("EXPECTED WORD AFTER `CONSTANT`");
+        stos_seterrstr ("`TASK:` IN SHARED DICTIONARY");
         return false;
     }
+#endif
 
-    stos_ssize_t id = stos_word_create (current_token.str, 0);
+    stos_ssize_t id = stos_word_create (current_token.str, current_token.len, 0);
     if (id < 0)
         return false;
 
-    stos_bc_emit_op (OPCODE_PUSH_CELL);
-    stos_bc_emit_addr (value);
+    stos_size_t i = stos_task_count++;
+    stos_tasks[i] = (struct stos_task){
+        .dstack = stos_task_dstacks[i - 1],
+        .rstack = stos_task_rstacks[i - 1],
+        .dsize = TASK_DATA_STACK_SIZE,
+        .rsize = TASK_RETURN_STACK_SIZE,
+        .state = TASK_STOPPED,
+    };
+
+    stos_bc_emit_literal (i);
     stos_bc_emit_op (OPCODE_RET);
     stos_word_finish (id);
-
     return true;
 }
 
 bool
-prim_create (void)
+prim_activate (void)
 {
-    if (stos_mode != MODE_INTERPRET)
+    if (stos_mode != MODE_COMPILE_TOKS || stos_scratch) // the task would outlive the code
     {
-        stos_seterrstr ("`CREATE` IN DEFINITION");
+        stos_seterrstr ("`ACTIVATE` OUTSIDE DEFINITION");
         return false;
     }
 
-    if (!stos_token_next () || current_token.type != TOKEN_WORD)
-        return false;
-
-    stos_cell_t addr = (stos_cell_t)&stos_varspace[stos_vsp];
-
-    stos_ssize_t id = stos_word_create (current_token.str, 0);
-    if (id < 0)
-        return false;
-
-    stos_bc_emit_op (OPCODE_PUSH_CELL);
-    stos_bc_emit_addr (addr);
-    stos_bc_emit_op (OPCODE_RET);
-    stos_word_finish (id);
+    stos_bc_emit_op (OPCODE_ACTIVATE);
+    return true;
+}
 
+bool
+prim_pause (void)
+{
+    stos_yield_req = true;
     return true;
 }
 
 bool
-prim_allot (void)
+prim_stop (void)
 {
-    if (stos_mode != MODE_INTERPRET)
+    stos_cell_t task;
+    if (!stos_pop (&task))
+        return false;
+
+    if (task == 0)
     {
-        stos_seterrstr ("`ALLOT` IN DEFINITION");
+        stos_seterrstr ("CAN'T STOP OPERATOR");
         return false;
     }
+    if (!stos_task_valid (task))
+        return false;
+
+    stos_tasks[task].state = TASK_STOPPED;
+    if ((stos_size_t)task == stos_task_cur)
+        stos_yield_req = true;
+    return true;
+}
 
+// ( n -- ) opcodes each line typed at the REPL may run, 0 turns the watchdog off
+bool
+prim_watchdog (void)
+{
     stos_cell_t n;
     if (!stos_pop (&n))
         return false;
 
-    if (stos_vsp + n > VARSPACE_SIZE)
-    {
-        stos_seterrstr ("VARIABLE SPACE AT CAPACITY");
+    stos_watchdog = n;
+    stos_watchdog_arm ();
+    return true;
+}
+
+// ( n -- ) opcodes a background task runs before it's preempted, 0 leaves switching to `pause`
+bool
+prim_slice (void)
+{
+    stos_cell_t n;
+    if (!stos_pop (&n))
         return false;
-    }
 
-    stos_vsp += n;
+    stos_task_slice = n;
+    stos_watchdog_arm ();
     return true;
 }
 
+// ( n -- ch ) a channel for n cells (rounded up to a power of two)
 bool
-prim_squote (void)
+prim_channel (void)
 {
-    if (stos_input_cursor == NULL)
-        stos_input_cursor = stos_input;
-
-    while (stos_isspace (*stos_input_cursor))
-        stos_input_cursor++;
+    stos_cell_t n;
+    if (!stos_pop (&n))
+        return false;
 
-    char *str_start = stos_input_cursor;
-    stos_size_t len = 0;
+    stos_size_t cap = 1;
+    while (cap < (stos_size_t)n && cap < CHANNEL_SLOTS)
+        cap <<= 1;
+    if ((stos_number_t)n < 1 || cap < (stos_size_t)n)
+    {
+        stos_seterrstr ("INVALID CHANNEL SIZE");
+        return false;
+    }
 
-    while (*stos_input_cursor != '"' && *stos_input_cursor != '\0')
+#ifdef _STOS_THREADS
+    pthread_mutex_lock (&stos_channel_lock);
+#endif
+    stos_size_t ch = stos_channel_count;
+    bool room = ch < MAX_CHANNELS && stos_channel_slots_used + cap <= CHANNEL_SLOTS;
+    if (room)
     {
-        len++;
-        stos_input_cursor++;
+        struct stos_channel *c = &stos_channels[ch];
+        c->slot = &stos_channel_slots[stos_channel_slots_used];
+        c->mask = cap - 1;
+        c->head = c->tail = 0;
+        for (stos_size_t i = 0; i < cap; i++)
+            c->slot[i].seq = i;
+#ifdef _STOS_THREADS
+        pthread_mutex_init (&c->lock, NULL);
+        pthread_cond_init (&c->moved, NULL);
+        c->sleepers = 0;
+#endif
+        stos_channel_slots_used += cap;
+        stos_atomic_store (&stos_channel_count, ch + 1);
     }
+#ifdef _STOS_THREADS
+    pthread_mutex_unlock (&stos_channel_lock);
+#endif
 
-    if (*stos_input_cursor != '"')
+    if (!room)
     {
-        stos_seterrstr ("UNTERMINATED STRING");
+        stos_seterrstr ("CHANNELS AT CAPACITY");
         return false;
     }
+    return stos_push (ch);
+}
 
-    stos_input_cursor++;
-
-    if (stos_mode == MODE_INTERPRET)
+// the channel is full (send) or empty. a background task parks: it gets its turn again once the channel moved,
+// and runs the primitive over. the operator lets its tasks run meanwhile, and with nothing else to do
+// sleeps until another thread moves the channel. a single threaded VM without any task to do that has to fail
+static bool
+stos_channel_block (struct stos_channel *c, stos_cell_t ch, bool send)
+{
+    if (stos_task_cur != 0)
     {
-        if (stos_strp + len + 1 >= STRINGSPACE_SIZE)
-        {
-            stos_seterrstr ("STRING TOO LONG");
-            return false;
-        }
-
-        stos_memcpy (stos_string + stos_strp, str_start, len);
-        stos_string[stos_strp + len] = '\0';
-
-        if (!stos_push ((stos_cell_t)stos_string + stos_strp))
-            return false;
-
-        stos_strp += len + 1;
-
-        return stos_push ((stos_cell_t)len);
+        struct stos_task *t = &stos_tasks[stos_task_cur];
+        t->wait = ch + 1;
+        t->wait_send = send;
+        stos_yield_req = stos_park_req = true;
+        return true;
     }
-    else if (stos_mode == MODE_COMPILE_TOKS)
-    {
-        stos_bc_emit_op (OPCODE_PUSH_STRING);
-        stos_bc_emit_size (len);
-
-        for (stos_size_t i = 0; i < len; i++)
-        {
-            stos_bytecode[stos_pc++] = str_start[i];
-        }
 
+    if (stos_tasks_ready ())
+    {
+        stos_tasks_round ();
         return true;
     }
 
+#ifdef _STOS_THREADS
+    pthread_mutex_lock (&c->lock);
+    atomic_fetch_add (&c->sleepers, 1);
+    if (!stos_channel_can (c, send))
+    {
+        // tasks parked on other channels get a look every STOS_POLL_MS
+        struct timespec until;
+        clock_gettime (CLOCK_REALTIME, &until);
+        until.tv_nsec += STOS_POLL_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait (&c->moved, &c->lock, &until);
+    }
+    atomic_fetch_sub (&c->sleepers, 1);
+    pthread_mutex_unlock (&c->lock);
+    return true;
+#else
+    (void)c;
+    stos_seterrstr (send ? "`SEND` WOULD WAIT FOREVER" : "`RECV` WOULD WAIT FOREVER");
     return false;
+#endif
 }
 
+// ( x ch -- ) waits while the channel is full
 bool
-prim_type (void)
+prim_send (void)
 {
-    stos_cell_t len, addr;
-    if (!stos_pop (&len) || !stos_pop (&addr))
+    stos_cell_t ch, v;
+    if (!stos_pop (&ch) || !stos_pop (&v))
+        return false;
+    struct stos_channel *c = stos_channel_of (ch);
+    if (!c)
         return false;
 
-    char *str = (char *)addr;
-    for (stos_size_t i = 0; i < len; i++)
-        stos_putc (str[i]);
-
-    if (stos_strp >= len + 1)
-        stos_strp -= (len + 1);
-    else
-        stos_strp = 0;
-
+    while (!stos_channel_put (c, v))
+    {
+        if (!stos_channel_block (c, ch, true))
+            return false;
+        if (stos_park_req) // the operands stay for the next try
+            return stos_push (v) && stos_push (ch);
+    }
+    stos_channel_moved (c);
     return true;
 }
 
+// ( ch -- x ) waits while the channel is empty
 bool
-prim_cellp (void)
+prim_recv (void)
 {
-    stos_cell_t addr;
-    if (!stos_pop (&addr))
+    stos_cell_t ch, v;
+    if (!stos_pop (&ch))
+        return false;
+    struct stos_channel *c = stos_channel_of (ch);
+    if (!c)
         return false;
 
-    return stos_push (addr + sizeof (stos_cell_t));
+    while (!stos_channel_get (c, &v))
+    {
+        if (!stos_channel_block (c, ch, false))
+            return false;
+        if (stos_park_req)
+            return stos_push (ch);
+    }
+    stos_channel_moved (c);
+    return stos_push (v);
 }
 
+// ( ch -- x true | false )
 bool
-prim_i (void)
+prim_try_recv (void)
 {
-    if (stos_rsp < 2)
-    {
-        stos_seterrstr ("`I` OUTSIDE OF DO LOOP");
+    stos_cell_t ch, v;
+    if (!stos_pop (&ch))
+        return false;
+    struct stos_channel *c = stos_channel_of (ch);
+    if (!c)
         return false;
-    }
 
-    stos_size_t index = stos_rstack[stos_rsp - 1];
-    return stos_push ((stos_number_t)index);
+    if (!stos_channel_get (c, &v))
+        return stos_push (0);
+    stos_channel_moved (c);
+    return stos_push (v) && stos_push (-1);
 }
 
 bool
 stos_register_primitives (void)
 {
-    bool r = !stos_primitive_compile (".", prim_dot, 0) ||                        //
-             !stos_primitive_compile (".s", prim_putstack, 0) ||                  //
-             !stos_primitive_compile (".\"", prim_putstr, STOS_IMMEDIATE) ||      //
-             !stos_primitive_compile ("type", prim_type, STOS_IMMEDIATE) ||       //
-             !stos_primitive_compile ("cr", prim_cr, 0) ||                        //
-             !stos_primitive_compile ("emit", prim_emit, 0) ||                    //
-             !stos_primitive_compile ("key", prim_key, 0) ||                      //
-             !stos_primitive_compile ("dup", prim_dup, 0) ||                      //
-             !stos_primitive_compile ("swap", prim_swap, 0) ||                    //
-             !stos_primitive_compile ("over", prim_over, 0) ||                    //
-             !stos_primitive_compile ("drop", prim_drop, 0) ||                    //
-             !stos_primitive_compile ("rot", prim_rot, 0) ||                      //
-             !stos_primitive_compile ("+", prim_plus, 0) ||                       //
-             !stos_primitive_compile ("-", prim_minus, 0) ||                      //
-             !stos_primitive_compile ("*", prim_mult, 0) ||                       //
-             !stos_primitive_compile ("/", prim_div, 0) ||                        //
-             !stos_primitive_compile ("mod", prim_mod, 0) ||                      //
-             !stos_primitive_compile ("=", prim_eq, 0) ||                         //
-             !stos_primitive_compile ("<", prim_lt, 0) ||                         //
-             !stos_primitive_compile ("<=", prim_lte, 0) ||                       //
-             !stos_primitive_compile (">", prim_gt, 0) ||                         //
-             !stos_primitive_compile (">=", prim_gte, 0) ||                       //
-             !stos_primitive_compile (":", prim_def, 0) ||                        //
-             !stos_primitive_compile (";", prim_enddef, STOS_IMMEDIATE) ||        //
-             !stos_primitive_compile ("if", prim_if, STOS_IMMEDIATE) ||           //
-             !stos_primitive_compile ("else", prim_else, STOS_IMMEDIATE) ||       //
-             !stos_primitive_compile ("then", prim_endif, STOS_IMMEDIATE) ||      //
-             !stos_primitive_compile ("do", prim_do, STOS_IMMEDIATE) ||           //
-             !stos_primitive_compile ("i", prim_i, 0) ||                          //
-             !stos_primitive_compile ("begin", prim_begin, STOS_IMMEDIATE) ||     //
-             !stos_primitive_compile ("until", prim_until, STOS_IMMEDIATE) ||     //
-             !stos_primitive_compile ("while", prim_while, STOS_IMMEDIATE) ||     //
-             !stos_primitive_compile ("repeat", prim_repeat, STOS_IMMEDIATE) ||   //
-             !stos_primitive_compile ("again", prim_again, STOS_IMMEDIATE) ||     //
-             !stos_primitive_compile ("loop", prim_loop, STOS_IMMEDIATE) ||       //
-             !stos_primitive_compile ("+loop", prim_ploop, STOS_IMMEDIATE) ||     //
-             !stos_primitive_compile ("recurse", prim_recurse, STOS_IMMEDIATE) || //
-             !stos_primitive_compile ("exit", prim_exit, STOS_IMMEDIATE) ||       //
-             !stos_primitive_compile ("variable", prim_var, 0) ||                 //
-             !stos_primitive_compile ("constant", prim_constant, 0) ||            //
-             !stos_primitive_compile ("create", prim_create, 0) ||                //
-             !stos_primitive_compile ("allot", prim_allot, 0) ||                  //
-             !stos_primitive_compile ("cells", prim_cells, 0) ||                  //
-             !stos_primitive_compile ("move", prim_move, 0) ||                    //
-             !stos_primitive_compile ("fill", prim_fill, 0) ||                    //
-             !stos_primitive_compile ("cell+", prim_cellp, 0) ||                  //
-             !stos_primitive_compile ("s\"", prim_squote, STOS_IMMEDIATE) ||      //
-             !stos_primitive_compile (">r", prim_tor, 0) ||                       //
-             !stos_primitive_compile ("r>", prim_fromr, 0) ||                     //
-             !stos_primitive_compile ("r@", prim_rfetch, 0) ||                    //
-             !stos_primitive_compile ("@", prim_fetch, 0) ||                      //
-             !stos_primitive_compile ("!", prim_store, 0) ||                      //
-             !stos_primitive_compile ("c@", prim_cfetch, 0) ||                    //
-             !stos_primitive_compile ("c!", prim_cstore, 0) ||                    //
-             !stos_primitive_compile ("words", prim_words, 0);                    //
+    bool r = !stos_primitive_compile (".", prim_dot, 0) ||                          //
+             !stos_primitive_compile (".\"", prim_putstr, STOS_IMMEDIATE) ||        //
+             !stos_primitive_compile ("cr", prim_cr, 0) ||                          //
+             !stos_primitive_compile ("emit", prim_emit, 0) ||                      //
+             !stos_primitive_compile ("key", prim_key, 0) ||                        //
+             !stos_primitive_compile ("key?", prim_keyq, 0) ||                      //
+             !stos_primitive_compile ("dup", prim_dup, 0) ||                        //
+             !stos_primitive_compile ("swap", prim_swap, 0) ||                      //
+             !stos_primitive_compile ("over", prim_over, 0) ||                      //
+             !stos_primitive_compile ("drop", prim_drop, 0) ||                      //
+             !stos_primitive_compile ("rot", prim_rot, 0) ||                        //
+             !stos_primitive_compile ("+", prim_plus, 0) ||                         //
+             !stos_primitive_compile ("-", prim_minus, 0) ||                        //
+             !stos_primitive_compile ("*", prim_mult, 0) ||                         //
+             !stos_primitive_compile ("=", prim_eq, 0) ||                           //
+             !stos_primitive_compile ("<", prim_lt, 0) ||                           //
+             !stos_primitive_compile ("<=", prim_lte, 0) ||                         //
+             !stos_primitive_compile (">", prim_gt, 0) ||                           //
+             !stos_primitive_compile (">=", prim_gte, 0) ||                         //
+             !stos_primitive_compile (":", prim_def, 0) ||                          //
+             !stos_primitive_compile (";", prim_enddef, STOS_IMMEDIATE) ||          //
+             !stos_primitive_compile ("exit", prim_exit, STOS_IMMEDIATE) ||         //
+             !stos_primitive_compile ("'", prim_tick, 0) ||                         //
+             !stos_primitive_compile ("[']", prim_bracket_tick, STOS_IMMEDIATE) ||  //
+             !stos_primitive_compile ("execute", prim_execute, STOS_IMMEDIATE) ||   //
+             !stos_primitive_compile ("catch", prim_catch, 0) ||                    //
+             !stos_primitive_compile ("throw", prim_throw, 0) ||                    //
+             !stos_primitive_compile ("variable", prim_var, 0) ||                   //
+             !stos_primitive_compile ("constant", prim_constant, 0) ||              //
+             !stos_primitive_compile (">r", prim_tor, 0) ||                         //
+             !stos_primitive_compile ("r>", prim_fromr, 0) ||                       //
+             !stos_primitive_compile ("r@", prim_rfetch, 0) ||                      //
+             !stos_primitive_compile ("@", prim_fetch, 0) ||                        //
+             !stos_primitive_compile ("!", prim_store, 0) ||                        //
+             !stos_primitive_compile ("c@", prim_cfetch, 0) ||                      //
+             !stos_primitive_compile ("c!", prim_cstore, 0) ||                      //
+             !stos_primitive_compile ("module", prim_module, 0) ||                  //
+             !stos_primitive_compile ("end-module", prim_end_module, 0) ||          //
+             !stos_primitive_compile ("require-module", prim_require_module, 0) ||  //
+             !stos_primitive_compile ("task:", prim_task, 0) ||                     //
+             !stos_primitive_compile ("activate", prim_activate, STOS_IMMEDIATE) || //
+             !stos_primitive_compile ("pause", prim_pause, 0) ||                    //
+             !stos_primitive_compile ("channel", prim_channel, 0) ||                //
+             !stos_primitive_compile ("send", prim_send, 0) ||                      //
+             !stos_primitive_compile ("recv", prim_recv, 0) ||                      //
+             !stos_primitive_compile ("try-recv", prim_try_recv, 0) ||              //
+             !stos_primitive_compile ("stop", prim_stop, 0) ||                      //
+             !stos_primitive_compile ("watchdog", prim_watchdog, 0) ||              //
+             !stos_primitive_compile ("slice", prim_slice, 0);                      //
+#ifndef _STOS_NO_CONTROL
+    r = r || !stos_primitive_compile ("if", prim_if, STOS_IMMEDIATE | STOS_STRUCTURE) ||  //
+        !stos_primitive_compile ("else", prim_else, STOS_IMMEDIATE) ||                    //
+        !stos_primitive_compile ("then", prim_endif, STOS_IMMEDIATE) ||                   //
+        !stos_primitive_compile ("do", prim_do, STOS_IMMEDIATE | STOS_STRUCTURE) ||       //
+        !stos_primitive_compile ("i", prim_i, 0) ||                                       //
+        !stos_primitive_compile ("begin", prim_begin, STOS_IMMEDIATE | STOS_STRUCTURE) || //
+        !stos_primitive_compile ("until", prim_until, STOS_IMMEDIATE) ||                  //
+        !stos_primitive_compile ("while", prim_while, STOS_IMMEDIATE) ||                  //
+        !stos_primitive_compile ("repeat", prim_repeat, STOS_IMMEDIATE) ||                //
+        !stos_primitive_compile ("again", prim_again, STOS_IMMEDIATE) ||                  //
+        !stos_primitive_compile ("loop", prim_loop, STOS_IMMEDIATE) ||                    //
+        !stos_primitive_compile ("+loop", prim_ploop, STOS_IMMEDIATE) ||                  //
+        !stos_primitive_compile ("pdo", prim_pdo, STOS_IMMEDIATE | STOS_STRUCTURE) ||     //
+        !stos_primitive_compile ("ploop", prim_pdo_loop, STOS_IMMEDIATE) ||               //
+        !stos_primitive_compile ("preduce", prim_pdo_reduce, STOS_IMMEDIATE) ||           //
+        !stos_primitive_compile ("recurse", prim_recurse, STOS_IMMEDIATE);                //
+#endif
+#ifndef _STOS_NO_DIVISION
+    r = r || !stos_primitive_compile ("/", prim_div, 0) || //
+        !stos_primitive_compile ("mod", prim_mod, 0);      //
+#endif
+#ifndef _STOS_NO_MEMORY
+    r = r || !stos_primitive_compile ("create", prim_create, 0) || //
+        !stos_primitive_compile ("allot", prim_allot, 0) ||        //
+        !stos_primitive_compile ("cells", prim_cells, 0) ||        //
+        !stos_primitive_compile ("move", prim_move, 0) ||          //
+        !stos_primitive_compile ("fill", prim_fill, 0) ||          //
+        !stos_primitive_compile ("cmove", prim_cmove, 0) ||        //
+        !stos_primitive_compile ("cmove>", prim_cmove_back, 0) ||  //
+        !stos_primitive_compile ("v+", prim_vadd, 0) ||            //
+        !stos_primitive_compile ("v*", prim_vmul, 0) ||            //
+        !stos_primitive_compile ("vscale", prim_vscale, 0) ||      //
+        !stos_primitive_compile ("vdot", prim_vdot, 0) ||          //
+        !stos_primitive_compile ("vsum", prim_vsum, 0) ||          //
+        !stos_primitive_compile ("vmin", prim_vmin, 0) ||          //
+        !stos_primitive_compile ("vmax", prim_vmax, 0) ||          //
+        !stos_primitive_compile ("fir", prim_fir, 0) ||            //
+        !stos_primitive_compile ("movavg", prim_movavg, 0) ||      //
+        !stos_primitive_compile ("cell+", prim_cellp, 0);          //
+#endif
+#ifndef _STOS_NO_STRINGS
+    r = r || !stos_primitive_compile ("type", prim_type, 0) ||          //
+        !stos_primitive_compile ("compare", prim_compare, 0) ||         //
+        !stos_primitive_compile ("search", prim_search, 0) ||           //
+        !stos_primitive_compile ("s\"", prim_squote, STOS_IMMEDIATE) || //
+        !stos_primitive_compile ("scopy", prim_scopy, 0);               //
+#endif
+#ifndef _STOS_NO_TOOLS
+    r = r || !stos_primitive_compile (".s", prim_putstack, 0) ||   //
+        !stos_primitive_compile ("(marker)", prim_do_marker, 0) || //
+        !stos_primitive_compile ("marker", prim_marker, 0) ||      //
+        !stos_primitive_compile ("forget", prim_forget, 0) ||      //
+        !stos_primitive_compile ("words", prim_words, 0);          //
+#endif
+#ifdef _STOS_BLOCKS
+    r = r || !stos_primitive_compile ("block", prim_block, 0) ||            //
+        !stos_primitive_compile ("buffer", prim_buffer, 0) ||               //
+        !stos_primitive_compile ("update", prim_update, 0) ||               //
+        !stos_primitive_compile ("save-buffers", prim_save_buffers, 0) ||   //
+        !stos_primitive_compile ("flush", prim_flush, 0) ||                 //
+        !stos_primitive_compile ("empty-buffers", prim_empty_buffers, 0) || //
+        !stos_primitive_compile ("load", prim_load, 0) ||                   //
+        !stos_primitive_compile ("list", prim_list, 0);                     //
+#endif
+#ifdef _STOS_MEMSTATS
+    r = r || !stos_primitive_compile (".mem", prim_mem, 0);
+#endif
+#if defined(_STOS_MMAP) && !defined(_STOS_SANDBOX) && !defined(_STOS_NO_FILES)
+    r = r || !stos_primitive_compile ("map-file", prim_map_file, 0) ||  //
+        !stos_primitive_compile ("map-file-rw", prim_map_file_rw, 0) || //
+        !stos_primitive_compile ("sync-file", prim_sync_file, 0) ||     //
+        !stos_primitive_compile ("unmap-file", prim_unmap_file, 0) ||   //
+        !stos_primitive_compile ("r/o", prim_ro, 0) ||                  //
+        !stos_primitive_compile ("w/o", prim_wo, 0) ||                  //
+        !stos_primitive_compile ("r/w", prim_rw, 0) ||                  //
+        !stos_primitive_compile ("open-file", prim_open_file, 0) ||     //
+        !stos_primitive_compile ("create-file", prim_create_file, 0) || //
+        !stos_primitive_compile ("close-file", prim_close_file, 0) ||   //
+        !stos_primitive_compile ("read-file", prim_read_file, 0) ||     //
+        !stos_primitive_compile ("read-line", prim_read_line, 0) ||     //
+        !stos_primitive_compile ("next-line", prim_next_line, 0) ||     //
+        !stos_primitive_compile ("write-file", prim_write_file, 0) ||   //
+        !stos_primitive_compile ("write-line", prim_write_line, 0) ||   //
+        !stos_primitive_compile ("flush-file", prim_flush_file, 0) ||   //
+        !stos_primitive_compile ("file-size", prim_file_size, 0);       //
+#endif
     return !r;
 }
 
+STOS_TLS stos_size_t stos_line_len = 0;
+
+// feeds one input character into the line being assembled in stos_input.
+// returns the line (and its length through len) once it's complete, NULL until then
 const char *
-stos_readline (void)
+stos_line_feed (char c, stos_size_t *len)
 {
-    stos_size_t iline = 0;
-
-    for (;;)
+    if (stos_line_len == INPUT_ACCUMULATOR_LEN - 1)
     {
-        if (iline == INPUT_ACCUMULATOR_LEN - 1)
-        {
-            stos_seterrstr ("LINE TO LONG");
-            return NULL;
-        }
+        stos_line_len = 0;
+        stos_seterrstr ("LINE TO LONG");
+        return NULL;
+    }
 
-        char c = stos_getc ();
-        // fprintf(stderr, "[CHAR 0x%02X]\r\n", c);
-        switch (c)
-        {
-        case 0 ... 2:
-            break;
-        case 3 ... 4: // EXT (CTRL+C), EOT (CTRL+D)
-            stos_input[0] = 0x04;
-            stos_input[1] = 0;
-            return stos_input;
-        case 5 ... 7:
-            break;
-        case '\r':
-        case '\n':
-            stos_input[iline] = 0;
-            return stos_input;
-        case '\b':
-            if (iline > 0)
-                --iline;
-            break;
-        case 14 ... 31:
-            break;
-        default:
-            stos_input[iline++] = c;
-            break;
-        }
+    // fprintf(stderr, "[CHAR 0x%02X]\r\n", c);
+    switch (c)
+    {
+    case 0 ... 2:
+        break;
+    case 3 ... 4: // EXT (CTRL+C), EOT (CTRL+D)
+        stos_input[0] = 0x04;
+        stos_input[1] = 0;
+        stos_line_len = 0;
+        *len = 1;
+        return stos_input;
+    case 5 ... 7:
+        break;
+    case '\r':
+    case '\n':
+        stos_input[stos_line_len] = 0;
+        *len = stos_line_len;
+        stos_line_len = 0;
+        return stos_input;
+    case '\b':
+        if (stos_line_len > 0)
+            --stos_line_len;
+        break;
+    case 14 ... 31:
+        break;
+    default:
+        stos_input[stos_line_len++] = c;
+        break;
     }
+    return NULL;
 }
 
 bool
 stos_init (void)
 {
+#ifdef _STOS_THREADS
+    if (!stos_vm_attach ())
+        return false;
+#elif defined(_STOS_MMAP)
+    if (!stos_bytecode && !stos_arenas_init ())
+        return false;
+#endif
     stos_dsp = 0;
+    stos_rstack = stos_rstack_main;
+    stos_rstack_size = RETURN_STACK_SIZE;
     stos_rsp = 0;
     stos_csp = 0;
-    stos_word_count = 0;
-    stos_prim_count = 0;
+    stos_str_reset ();
+    stos_word_count = stos_word_lo;
+    stos_pc = stos_pc_lo;
+    stos_vsp = stos_vsp_lo;
+    stos_module_word = stos_word_lo;
+    stos_module_pc = stos_pc_lo;
+    stos_module_vsp = stos_vsp_lo;
+    stos_line_len = 0;
+    stos_scratch = false;
+    stos_run_pending = false;
+    stos_tasks_reset ();
+#ifdef _STOS_MEMSTATS
+    stos_mem_hw = (struct stos_mem){ 0 };
+    stos_mem_stacks[0] = stos_mem_stacks[1] = (struct stos_mem_stacks){ 0 };
+    stos_mem_slot = 0;
+#endif
     stos_mode_set (MODE_INTERPRET);
     stos_input_clear ();
+#ifdef _STOS_THREADS
+    stos_vars_synced = 0;
+    return true; // the primitives are in the shared dictionary
+#else
+    stos_prim_count = 0;
     return stos_register_primitives ();
+#endif
+}
+
+static void
+stos_scratch_open (void)
+{
+    stos_scratch = true;
+    stos_scratch_pc = stos_pc;
+    stos_scratch_csp = stos_csp;
+    stos_scratch_vsp = stos_vsp;
+    stos_mode_set (MODE_COMPILE_TOKS);
+}
+
+// runs the structure once its last word closed it, then gives the bytecode back - unless the code defined
+// (or forgot) words, which leaves stos_pc where they put it. the literals' varspace goes back too, if the code
+// didn't allot anything after it
+static bool
+stos_scratch_run (void)
+{
+    stos_size_t pc = stos_scratch_pc, vsp = stos_scratch_vsp, words = stos_word_count, vsp_compiled = stos_vsp;
+    stos_bc_emit_op (OPCODE_RET);
+    if (stos_pc > stos_pc_hi)
+    {
+        stos_seterrstr ("BYTECODE AT CAPACITY");
+        return false;
+    }
+    stos_scratch = false; // `load` may open structures of its own
+    stos_mode_set (MODE_INTERPRET);
+
+    struct stos_frame frame;
+    stos_frame_enter (&frame, false);
+    bool thrown = stos_setjmp (frame.env) != 0;
+    bool ok = false;
+    if (!thrown)
+    {
+        ok = stos_exec (pc, stos_rsp);
+        stos_frame_leave (&frame);
+    }
+
+    if (thrown)
+        stos_scratch_drop (); // one the code was compiling (through `load`) goes, then this one
+    if (stos_word_count == words)
+    {
+        stos_pc = pc;
+        if (stos_vsp == vsp_compiled)
+            stos_vsp = vsp;
+    }
+    if (thrown)
+        stos_rethrow ();
+    return ok;
 }
 
 bool
@@ -1662,11 +5922,13 @@ stos_token_exec (void)
             break;
         case TOKEN_WORD: {
             uint16_t wid;
-            if (!stos_strto_wrdid (current_token.str, &wid))
+            if (!stos_strto_wrdid (current_token.str, current_token.len, &wid))
             {
                 stos_seterrstr ("INVALID WORD");
                 return false;
             }
+            if (stos_words[wid].flags & STOS_STRUCTURE)
+                stos_scratch_open ();
             return stos_word_exec (wid);
         }
         case TOKEN_EOEXPR:
@@ -1681,27 +5943,220 @@ stos_token_exec (void)
             stos_seterrstr ("UNEXPECTED TOKEN AFTER BEGINNING OF DEFINITION");
             return false;
         }
-        stos_word_create (current_token.str, 0);
+        if (stos_word_create (current_token.str, current_token.len, 0) < 0)
+            return false;
         stos_mode_set (MODE_COMPILE_TOKS);
         break;
     }
-    case MODE_COMPILE_TOKS: {
-        if (!stos_token_compile ())
+    case MODE_COMPILE_TOKS:
+        return stos_token_compile (); // stos_recover drops the definition if this fails
+    }
+    return true;
+}
+
+// puts the VM back into a usable state after an error: the definition being compiled (if any) is dropped,
+// and the return and compile stacks are emptied. the data stack is left for the user to inspect
+void
+stos_recover (void)
+{
+    if (stos_scratch)
+        stos_scratch_drop ();
+    else if (stos_mode == MODE_COMPILE_TOKS || stos_pc > stos_pc_hi) // either way, the last word is incomplete
+        stos_dict_rollback (stos_word_count - 1, stos_vsp);
+    stos_mode = stos_mode_prev = MODE_INTERPRET;
+    stos_rsp = stos_csp = 0;
+}
+
+bool
+stos_interpret (void)
+{
+    do
+    {
+        stos_token_next ();
+        if (!stos_token_exec ())
+            return false;
+        if (stos_pc > stos_pc_hi)
         {
-            stos_pc = stos_words[stos_word_count].code_off; // reset bytecode
+            stos_seterrstr ("BYTECODE AT CAPACITY");
             return false;
         }
-        return true;
+        if (stos_scratch && stos_csp == stos_scratch_csp && !stos_scratch_run ())
+            return false;
+    } while (current_token.type != TOKEN_EOEXPR);
+    return true;
+}
+
+// interprets src as if it was typed at the REPL. on failure stos_errstr says why
+bool
+stos_eval (const char *src, size_t len)
+{
+    if (stos_run_pending)
+    {
+        stos_seterrstr ("RUN IN PROGRESS");
+        return false;
+    }
+    stos_str_reset (); // the previous run's strings stay readable until now
+    stos_watchdog_arm ();
+    stos_input_set (src, len);
+
+    bool ok = stos_guarded (stos_interpret);
+
+    stos_input_clear ();
+    if (!ok)
+        stos_recover ();
+    stos_dict_trim ();
+    return ok;
+}
+
+STOS_TLS uint16_t stos_call_id;
+
+static bool
+stos_call_exec (void)
+{
+    return stos_word_exec (stos_call_id);
+}
+
+bool
+stos_call (const char *name)
+{
+    if (stos_run_pending)
+    {
+        stos_seterrstr ("RUN IN PROGRESS");
+        return false;
     }
+    if (!stos_strto_wrdid (name, stos_strlen (name), &stos_call_id))
+    {
+        stos_seterrstr ("INVALID WORD");
+        return false;
     }
-    return true;
+
+    stos_str_reset ();
+    stos_watchdog_arm ();
+
+    bool ok = stos_guarded (stos_call_exec);
+    if (!ok)
+        stos_recover ();
+    stos_dict_trim ();
+    return ok;
 }
 
-int
-main (void)
+static bool
+stos_run_exec (void)
+{
+    stos_run_resumable = true;
+    return stos_exec (stos_run_pc, stos_run_base);
+}
+
+static enum stos_run_status
+stos_run_slice (stos_size_t n)
+{
+    stos_size_t grant = n ? n + 1 : 0; // the budget runs out on the opcode it would have run next
+    if (stos_watchdog && (!grant || grant > stos_watchdog_left))
+        grant = stos_watchdog_left;
+    stos_budget_grant (grant);
+    stos_run_stopped = false;
+
+    bool ok = stos_guarded (stos_run_exec);
+    stos_run_resumable = false;
+    stos_run_pending = ok && stos_run_stopped;
+    if (!ok)
+        stos_recover ();
+    stos_dict_trim ();
+    if (!ok)
+        return STOS_RUN_ERROR;
+    return stos_run_pending ? STOS_RUN_YIELDED : STOS_RUN_DONE;
+}
+
+enum stos_run_status
+stos_run (const char *name, stos_size_t n)
+{
+    if (stos_run_pending)
+    {
+        stos_seterrstr ("RUN IN PROGRESS");
+        return STOS_RUN_ERROR;
+    }
+    uint16_t id;
+    if (!stos_strto_wrdid (name, stos_strlen (name), &id))
+    {
+        stos_seterrstr ("INVALID WORD");
+        return STOS_RUN_ERROR;
+    }
+    if (stos_words[id].flags & STOS_PRIMITIVE) // nothing to stop in
+        return stos_call (name) ? STOS_RUN_DONE : STOS_RUN_ERROR;
+
+    stos_str_reset ();
+    stos_watchdog_arm ();
+    stos_run_pc = stos_words[id].code_off;
+    stos_run_base = stos_rsp;
+    return stos_run_slice (n);
+}
+
+enum stos_run_status
+stos_resume (stos_size_t n)
+{
+    if (!stos_run_pending)
+    {
+        stos_seterrstr ("NO RUN TO RESUME");
+        return STOS_RUN_ERROR;
+    }
+    return stos_run_slice (n);
+}
+
+void
+stos_run_cancel (void)
+{
+    if (!stos_run_pending)
+        return;
+    stos_run_pending = false;
+    stos_rsp = stos_run_base;
+}
+
+// checkpoints, for hosts that run many independent scripts on one prepared VM
+
+void
+stos_mark_take (struct stos_mark *m)
+{
+    m->words = stos_word_count;
+    m->vsp = stos_vsp;
+    m->tasks = stos_task_count;
+    m->slice = stos_task_slice;
+    m->watchdog = stos_watchdog;
+}
+
+// forgets everything defined since the mark, stops the tasks and empties the stacks.
+// variables keep their values, stos_vars lets the host put them back too
+void
+stos_mark_reset (const struct stos_mark *m)
+{
+    stos_recover ();
+    stos_dict_rollback (m->words, m->vsp);
+    stos_dict_trim ();
+    for (stos_size_t i = 1; i < stos_task_count; i++)
+        stos_tasks[i].state = TASK_STOPPED;
+    stos_task_count = m->tasks;
+    stos_task_slice = m->slice;
+    stos_watchdog = m->watchdog;
+    stos_run_pending = false;
+    stos_dsp = 0;
+    stos_str_reset ();
+    stos_input_clear ();
+    stos_line_len = 0;
+    stos_key_pending = -1;
+}
+
+uint8_t *
+stos_vars (stos_size_t *used)
 {
-    stos_preinit ();
+    if (used)
+        *used = stos_vsp;
+    return stos_varspace;
+}
 
+// the interactive frontend: an event loop that assembles lines a character at a time
+// and keeps the tasks running in between. never returns
+void
+stos_repl (void)
+{
     if (!stos_init ())
     {
 #ifdef _STOS_INTERACTIVE
@@ -1721,38 +6176,40 @@ main (void)
     stos_puts ("READY");
 #endif
 
+    bool prompt = true;
     while (true)
     {
+        if (prompt)
+        {
 #ifdef _STOS_INTERACTIVE
-        if (stos_mode == MODE_INTERPRET)
-            stos_write ("STOS>> ");
-        else
-            stos_write ("....>> ");
+            if (stos_mode == MODE_INTERPRET)
+                stos_write ("STOS>> ");
+            else
+                stos_write ("....>> ");
 #endif
+            prompt = false;
+        }
 
-        const char *line = stos_readline ();
-        if (!line || !*line)
+        int c = stos_key_nb ();
+        if (c < 0)
         {
-            stos_input_clear ();
+            stos_idle ();
             continue;
         }
 
-        do
+        stos_size_t len;
+        const char *line = stos_line_feed ((char)c, &len);
+        if (!line)
+            continue;
+
+        prompt = true;
+        if (len && !stos_eval (line, len))
         {
-            stos_token_next ();
-            if (!stos_token_exec ())
-            {
 #ifdef _STOS_INTERACTIVE
-                stos_write ("ERR. ");
-                stos_puts (stos_errstr);
+            stos_write ("ERR. ");
+            stos_puts (stos_errstr);
 #endif
-                stos_mode = MODE_INTERPRET;
-                stos_pc = 0;
-                break;
-            }
-        } while (current_token.type != TOKEN_EOEXPR);
-
-        stos_input_clear ();
+        }
     }
 }
 
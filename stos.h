@@ -44,28 +44,183 @@ typedef uint8_t bool;
 #include <stdbool.h>
 #endif
 
-#define INPUT_ACCUMULATOR_LEN 128
+#ifdef _STOS_MMAP
+// host builds: these regions only reserve address space, pages are committed as they get used
+#define DATA_STACK_SIZE (1u << 20)
+#define BYTECODE_SIZE (64u << 20)
+#define VARSPACE_SIZE (64u << 20)
+#define MAX_WORDS (1u << 16) // word ids are 16 bits wide
+#define MAX_MAPPED_FILES 16 // `map-file`s a VM has open at once
+#define MAX_OPEN_FILES 16
+#define FILE_BUFFER_SIZE (64u << 10) // read-ahead, and as much write-behind, for each open file
+#else
 #define DATA_STACK_SIZE 128
 #define BYTECODE_SIZE 1024
 #define VARSPACE_SIZE 256
-#define STRINGSPACE_SIZE 16
 #define MAX_WORDS 256 // including primitives, variables and constants
-#define MAX_PRIMITIVES 64
+#endif
+
+#define INPUT_ACCUMULATOR_LEN 128
+#ifdef _STOS_NO_STRINGS
+#define STRINGSPACE_SIZE 0
+#else
+#define STRINGSPACE_SIZE 64 // transient strings, reclaimed after every input line
+#endif
+#define MAX_PRIMITIVES 128
 #define RETURN_STACK_SIZE 64
 #define COMPILE_STACK_SIZE 32
-#define MAX_STRING_SIZE 12
+#define MAX_STRING_SIZE 16
+
+#ifdef _STOS_BLOCKS
+// block storage: `block` and friends, over the block device the host implements (see the hardware interface)
+#define BLOCK_SIZE 1024
+#ifdef _STOS_MMAP
+#define BLOCK_BUFFERS 32 // blocks cached in RAM, the least recently used one goes first
+#else
+#define BLOCK_BUFFERS 2
+#endif
+#define STOS_BLOCK_SPACE (BLOCK_BUFFERS * BLOCK_SIZE)
+#else
+#define STOS_BLOCK_SPACE 0
+#endif
+
+#ifdef _STOS_SANDBOX
+// addresses FORTH code sees are offsets into the varspace, and every access is masked into it. a bad address
+// reads or writes the wrong cell, never the host's memory. the string space (and the block buffers)
+// move into the top of the varspace
+#define STOS_VARS_LIMIT (VARSPACE_SIZE - STRINGSPACE_SIZE - STOS_BLOCK_SPACE)
+_Static_assert ((VARSPACE_SIZE & (VARSPACE_SIZE - 1)) == 0, "sandboxed VARSPACE_SIZE has to be a power of two");
+_Static_assert (STRINGSPACE_SIZE + STOS_BLOCK_SPACE < VARSPACE_SIZE, "string space doesn't fit into the varspace");
+#else
+#define STOS_VARS_LIMIT VARSPACE_SIZE
+#endif
+
+#ifdef _STOS_THREADS
+// one VM per thread. the lower part of the dictionary and of the bytecode is shared by all of them, read-only
+// except through stos_share, the rest is cut into a private slice for each VM. stacks and varspace are per VM,
+// the shared words' variables sit at the bottom of every varspace
+#ifndef _STOS_MMAP
+#error "_STOS_THREADS needs _STOS_MMAP"
+#endif
+#define MAX_VMS 16
+#define SHARED_WORDS (MAX_WORDS / 2)
+#define SHARED_BYTECODE_SIZE (BYTECODE_SIZE / 2)
+#define SHARED_VARSPACE_SIZE (VARSPACE_SIZE / 16)
+#ifndef PDO_THREADS
+#define PDO_THREADS 0 // workers that run `pdo` loops, 0 for one per core (-DPDO_THREADS=n forces a pool of n)
+#endif
+#define MAX_PDO_THREADS 32
+#define PDO_DATA_STACK_SIZE 256 // each one starts with a copy of the caller's data stack
+#define STOS_TLS _Thread_local
+_Static_assert (MAX_VMS <= 32, "VM slots are a 32 bit mask");
+_Static_assert (SHARED_VARSPACE_SIZE < STOS_VARS_LIMIT, "no varspace left for the VMs");
+#else
+#define STOS_TLS
+#endif
+#define MAX_TASKS 4 // including the operator
+#define TASK_DATA_STACK_SIZE 16
+#define TASK_RETURN_STACK_SIZE 16
+#define TASK_SLICE 1000 // opcodes a task runs before it's preempted, the `slice` word changes it
+#define STOS_POLL_MS 10 // longest the idle REPL sleeps in stos_poll before another round of tasks
+#define MAX_CHANNELS 8
+#define CHANNEL_SLOTS 256 // cells all channels together can hold
 
 _Static_assert (MAX_PRIMITIVES <= MAX_WORDS, "primitives can't fit into words");
+_Static_assert (MAX_TASKS >= 2, "no room for background tasks");
+_Static_assert ((CHANNEL_SLOTS & (CHANNEL_SLOTS - 1)) == 0, "channels are rings of a power of two");
+
+// widths of bytecode operands. _STOS_COMPACT_BC sizes them for the configuration above,
+// and adds one and two byte literal opcodes (for MCUs, where the bytecode space is tight)
+#ifdef _STOS_COMPACT_BC
+#define SIZEOF_WORD_ID (MAX_WORDS <= 256 ? 1 : 2)
+#define SIZEOF_BC_ADDR (BYTECODE_SIZE <= 65536 ? 2 : 4)
+#define SIZEOF_VAR_OFF (VARSPACE_SIZE <= 256 ? 1 : VARSPACE_SIZE <= 65536 ? 2 : 4)
+#define SIZEOF_STR_LEN 1
+#else
+#define SIZEOF_WORD_ID sizeof (stos_size_t)
+#define SIZEOF_BC_ADDR sizeof (stos_size_t)
+#define SIZEOF_VAR_OFF sizeof (stos_size_t)
+#define SIZEOF_STR_LEN sizeof (stos_size_t)
+#endif
+
+// vector kernels for the memory primitives (move, fill, compare, search).
+// picked from the target flags, define _STOS_NO_SIMD to force the portable word-at-a-time versions
+#if !defined(_STOS_NO_SIMD) && defined(__AVX2__)
+#define STOS_SIMD_AVX2
+#endif
+#if !defined(_STOS_NO_SIMD) && defined(__SSE2__)
+#define STOS_SIMD_SSE2
+#endif
 
 // word flags
 #define STOS_PRIMITIVE 1
 #define STOS_IMMEDIATE 2
+#define STOS_STRUCTURE 4 // opens a control structure, which then works outside of definitions too
 
 typedef bool (*stos_primitive_fn) (void);
 
+// embedding. the host links libstos (or stos.c) and implements the hardware interface below.
+// stos_init has to come first, again after a reboot (which forgets primitives registered by the host)
+bool stos_init (void);
+bool stos_eval (const char *src, size_t len); // interprets src like a line typed at the REPL
+bool stos_call (const char *name);            // runs a word by name
+bool stos_push (stos_cell_t n);
+bool stos_pop (stos_cell_t *n);
+bool stos_primitive_compile (const char *name, stos_primitive_fn fn, uint8_t flags); // a host primitive
+void stos_repl (void);                         // the interactive frontend, never returns
+extern STOS_TLS const char *stos_errstr;       // why the last call failed
+
+// resumable runs: stos_run starts a word like stos_call, but gives control back after n opcodes (0 for no limit).
+// stos_resume carries on where it stopped, stos_run_cancel drops it. while a run is suspended, the host can't
+// eval, call or start another one
+enum stos_run_status
+{
+    STOS_RUN_DONE,
+    STOS_RUN_YIELDED, // out of opcodes, stos_resume continues it
+    STOS_RUN_ERROR,   // stos_errstr says why, the run is over
+};
+enum stos_run_status stos_run (const char *name, stos_size_t n);
+enum stos_run_status stos_resume (stos_size_t n);
+void stos_run_cancel (void);
+
+#ifdef _STOS_THREADS
+// stos_init gives the calling thread its own VM, the functions above work on that one
+bool stos_share (const char *src, size_t len); // like stos_eval, but the new words go to every VM
+void stos_detach (void);                       // gives the thread's VM back, before the thread exits
+#endif
+
+// checkpoints, for running many independent scripts on one prepared VM
+struct stos_mark
+{
+    stos_size_t words, vsp, tasks;
+    stos_size_t slice, watchdog;
+};
+void stos_mark_take (struct stos_mark *m);
+void stos_mark_reset (const struct stos_mark *m); // forget everything since, stop tasks, empty stacks
+uint8_t *stos_vars (stos_size_t *used);           // varspace, and how much of it is allocated
+
+#ifdef _STOS_MEMSTATS
+// high-water marks since stos_init, for sizing the configuration above. `.mem` prints them, stos-size turns them into one
+struct stos_mem
+{
+    stos_size_t dsp, rsp, csp;      // the operator's stacks, in cells
+    stos_size_t task_dsp, task_rsp; // the deepest any background task went
+    stos_size_t pc, vsp, strp;      // bytes of bytecode, varspace and string space
+    stos_size_t words;              // dictionary entries, primitives included
+    stos_size_t prims;              // primitive slots taken
+};
+void stos_mem_high (struct stos_mem *m);
+#endif
+
 // hardware interface
 void stos_preinit (void);
 char stos_getc (void);
+int stos_getc_nb (void);                 // -1 if there's no input waiting
+void stos_poll (stos_size_t timeout_ms); // sleep until there's input, or timeout_ms passes
 void stos_putc (char c);
+#ifdef _STOS_BLOCKS
+bool stos_block_read (stos_cell_t n, uint8_t *buf);        // BLOCK_SIZE bytes of block n, false if that failed
+bool stos_block_write (stos_cell_t n, const uint8_t *buf); // false if it didn't make it to the device
+#endif
 
 #endif